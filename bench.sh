@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# make bench: time sgrep against grep -F on synthetic corpora.
+#
+# Every corpus kind of bench_gen is generated once into BENCH_DIR, BENCH_MB
+# MiB each, and searched for the word the generator plants in it with each
+# of -c, -q, -n and -B 2, by sgrep and by grep -F. Each search runs once to
+# warm the page cache and is then timed BENCH_RUNS times, the best run
+# counting. The results go to standard output as tab-separated values, one
+# line per corpus, mode and tool:
+#
+#   corpus  bytes  mode  tool  seconds  gbps  status  same
+#
+# where status is the exit status and same says whether the output and
+# status agree with those of grep -F.
+
+set -e
+
+BENCH_DIR=${BENCH_DIR:-bench-data}
+BENCH_MB=${BENCH_MB:-1024}
+BENCH_RUNS=${BENCH_RUNS:-3}
+SGREP=${SGREP:-./sgrep}
+GEN=${GEN:-./bench_gen}
+GREP=${GREP:-grep}
+
+PATTERN=sgrepmark
+KINDS="log prose long dense sparse"
+
+# the options of each mode, the mode being named after them
+MODES=("-c" "-q" "-n" "-B 2")
+
+export LC_ALL=C
+
+mkdir -p "$BENCH_DIR"
+
+# time BENCH_RUNS runs of a command, its output going to $out, leaving the
+# microseconds of the best one in $best and the exit status in $status
+best_of()
+{
+    local t0 t1 us
+    best=
+    "$@" > "$out" || true
+    for ((i = 0; i < BENCH_RUNS; i++)); do
+        t0=${EPOCHREALTIME/./}
+        status=0
+        "$@" > "$out" || status=$?
+        t1=${EPOCHREALTIME/./}
+        us=$((t1 - t0))
+        if [ -z "$best" ] || [ "$us" -lt "$best" ]; then
+            best=$us
+        fi
+    done
+}
+
+printf 'corpus\tbytes\tmode\ttool\tseconds\tgbps\tstatus\tsame\n'
+
+for kind in $KINDS; do
+    corpus=$BENCH_DIR/$kind-${BENCH_MB}M.txt
+    if [ ! -f "$corpus" ]; then
+        echo "bench: generating $corpus" >&2
+        "$GEN" "$kind" "$BENCH_MB" > "$corpus.tmp"
+        mv "$corpus.tmp" "$corpus"
+    fi
+    bytes=$(stat -c %s "$corpus")
+
+    for mode in "${MODES[@]}"; do
+        # $mode is split into its words on purpose
+        out=$BENCH_DIR/out.grep
+        best_of "$GREP" -F $mode "$PATTERN" "$corpus"
+        grep_us=$best grep_status=$status
+        out=$BENCH_DIR/out.sgrep
+        best_of "$SGREP" $mode "$PATTERN" "$corpus"
+        sgrep_us=$best sgrep_status=$status
+
+        same=yes
+        if [ "$sgrep_status" != "$grep_status" ] || ! cmp -s "$BENCH_DIR/out.sgrep" "$BENCH_DIR/out.grep"; then
+            same=no
+        fi
+        for tool in sgrep grep; do
+            if [ $tool = sgrep ]; then us=$sgrep_us st=$sgrep_status; else us=$grep_us st=$grep_status; fi
+            awk -v c="$kind" -v b="$bytes" -v m="$mode" -v t="$tool" -v us="$us" -v st="$st" -v same="$same" \
+                'BEGIN { printf "%s\t%d\t%s\t%s\t%.4f\t%.2f\t%d\t%s\n", c, b, m, t, us / 1e6, b / (us * 1e3), st, same }'
+        done
+    done
+done
+
+rm -f "$BENCH_DIR/out.sgrep" "$BENCH_DIR/out.grep"
@@ -0,0 +1,163 @@
+#include "mu.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bench_gen: write a synthetic corpus for make bench to standard output.
+// The same KIND, size and seed always give the same bytes, so results from
+// different machines and revisions are comparable. Every kind holds the
+// word BENCH_MARK at its own rate, which is what the benchmark searches for.
+
+#define USAGE "usage: bench_gen log|prose|long|dense|sparse MB [SEED]"
+
+#define BENCH_MARK "sgrepmark"
+
+// xorshift64*, enough for picking words
+static uint64_t state;
+
+static uint64_t
+rnd(void)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+}
+
+// a number below n, the small ones far more likely than the large ones,
+// much as word frequencies in text are
+static size_t
+rnd_skewed(size_t n)
+{
+    uint64_t a = rnd() % n;
+    uint64_t b = rnd() % n;
+
+    return a * b / n;
+}
+
+static const char *words[] = {
+    "the",     "of",       "and",      "to",      "a",        "in",       "that",    "it",      "was",
+    "she",     "he",       "you",      "said",    "for",      "on",       "as",      "with",    "at",
+    "her",     "his",      "had",      "be",      "not",      "but",      "all",     "so",      "they",
+    "this",    "what",     "were",     "one",     "there",    "would",    "little",  "out",     "up",
+    "very",    "about",    "if",       "could",   "down",     "into",     "like",    "went",    "then",
+    "them",    "know",     "again",    "see",     "time",     "began",    "thought", "way",     "off",
+    "head",    "thing",    "queen",    "turtle",  "looked",   "voice",    "rabbit",  "great",   "first",
+    "quite",   "round",    "never",    "found",   "another",  "garden",   "door",    "table",   "house",
+    "curious", "wondered", "whispered", "trembling", "remarkable", "afternoon", "presently", "anxiously",
+    "croquet", "pepper",   "lobster",  "caterpillar", "mushroom", "treacle", "gryphon",  "dormouse",
+    "melancholy", "procession", "executioner", "uncomfortable", "conversation", "extraordinary",
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+static const char *levels[] = {"INFO", "INFO", "INFO", "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+static const char *paths[] = {"/api/v1/users", "/api/v1/orders", "/api/v2/search", "/static/app.js",
+                              "/healthz",      "/login",          "/api/v1/cart",   "/metrics"};
+static const int codes[] = {200, 200, 200, 200, 200, 201, 204, 304, 404, 500};
+
+#define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+// words up to about len bytes, the mark among them one time in rate
+static size_t
+words_put(FILE *fp, size_t len, uint64_t rate)
+{
+    size_t n = 0;
+
+    while (n < len)
+    {
+        const char *w = rnd() % rate == 0 ? BENCH_MARK : words[rnd_skewed(NWORDS)];
+
+        if (n > 0)
+        {
+            putc(' ', fp);
+            n++;
+        }
+        fputs(w, fp);
+        n += strlen(w);
+    }
+    return n;
+}
+
+// one line of a request log, about 130 bytes
+static size_t
+log_line(FILE *fp, uint64_t line, uint64_t rate)
+{
+    uint64_t ms = line * 37;
+    int n;
+
+    n = fprintf(fp, "2024-03-%02d %02d:%02d:%02d.%03d host-%02d %s[%d] %s %s %s status=%d bytes=%d dur=%dms id=%016llx%s\n",
+                (int)(1 + ms / 86400000 % 28), (int)(ms / 3600000 % 24), (int)(ms / 60000 % 60), (int)(ms / 1000 % 60),
+                (int)(ms % 1000), (int)(rnd() % 32), rnd() % 2 ? "api" : "web", (int)(1000 + rnd() % 9000),
+                levels[rnd() % NELEMS(levels)], rnd() % 4 ? "GET" : "POST", paths[rnd_skewed(NELEMS(paths))],
+                codes[rnd() % NELEMS(codes)], (int)(rnd() % 65536), (int)(rnd_skewed(2000)),
+                (unsigned long long)rnd(), rnd() % rate == 0 ? " trace=" BENCH_MARK : "");
+    return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static char buf[1 << 20];
+    unsigned long long total, written = 0, line = 0;
+    long mb, seed = 1;
+    const char *kind;
+
+    if (argc < 3 || argc > 4 || mu_str_to_long(argv[2], 10, &mb) != 0 || mb <= 0 ||
+        (argc == 4 && mu_str_to_long(argv[3], 10, &seed) != 0))
+    {
+        mu_die(USAGE);
+    }
+    kind = argv[1];
+    total = (unsigned long long)mb << 20;
+    state = 0x9e3779b97f4a7c15ULL ^ (uint64_t)seed;
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+
+    // lines of prose are 40 to 100 bytes, long lines 4 to 64 KiB
+    while (written < total)
+    {
+        if (strcmp(kind, "log") == 0)
+        {
+            written += log_line(stdout, line, 1000);
+            line++;
+            continue;
+        }
+
+        if (strcmp(kind, "prose") == 0)
+        {
+            // a blank line between paragraphs
+            if (rnd() % 8 == 0)
+            {
+                putchar('\n');
+                written++;
+            }
+            written += words_put(stdout, 40 + rnd() % 60, 1000);
+        }
+        else if (strcmp(kind, "long") == 0)
+        {
+            written += words_put(stdout, 4096 + rnd() % 61440, 20000);
+        }
+        else if (strcmp(kind, "dense") == 0)
+        {
+            written += words_put(stdout, 40 + rnd() % 60, 10);
+        }
+        else if (strcmp(kind, "sparse") == 0)
+        {
+            written += words_put(stdout, 40 + rnd() % 60, 2000000);
+        }
+        else
+        {
+            mu_die(USAGE);
+        }
+        putchar('\n');
+        written++;
+    }
+
+    if (fflush(stdout) != 0 || ferror(stdout))
+    {
+        mu_die_errno(errno, "bench_gen: write error");
+    }
+    return 0;
+}
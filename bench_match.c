@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+
+#include "mu.h"
+#include "search.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// bench_match: time the substring search kernels on their own, on buffers
+// in memory, away from reading files and writing lines. For every pattern
+// length, alphabet size and density of planted matches each kernel this CPU
+// runs finds every occurrence of a random pattern in a random buffer; glibc's
+// memmem is timed alongside for comparison. The results go to standard
+// output as tab-separated values:
+//
+//   kernel  patlen  alphabet  hits_per_mib  ns_per_byte  gbps  matches  cands_per_kib  verified_pct
+//
+// where cands_per_kib is how many positions per KiB the kernel had to
+// verify with a memcmp, and verified_pct the share of those that matched.
+
+#define USAGE "usage: bench_match [MB]"
+
+// each buffer is timed this many times, the best run counting
+#define BENCH_RUNS 3
+
+static const size_t lengths[] = {1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 64, 128, 256};
+static const int alphabets[] = {2, 4, 26, 95, 255};
+static const size_t densities[] = {0, 16, 1024};
+
+#define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef const char *(*find_fn)(const struct pattern *pat, const char *hay, size_t n);
+
+// what the horspool kernel searches with, which the scalar one also hands
+// long patterns to
+static search_fn horspool;
+
+// xorshift64*, for the buffers and patterns
+static uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+rnd(void)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+}
+
+// the i-th byte of an alphabet of size k: lower case letters first, then
+// the rest of printable ASCII, then everything else but NUL, which a
+// pattern cannot hold
+static char
+alpha_byte(int k, uint64_t r)
+{
+    static char order[255];
+    static int n;
+    int c;
+
+    if (n == 0)
+    {
+        for (c = 'a'; c <= 'z'; c++)
+        {
+            order[n++] = c;
+        }
+        for (c = ' '; c <= '~'; c++)
+        {
+            if (c < 'a' || c > 'z')
+            {
+                order[n++] = c;
+            }
+        }
+        for (c = 1; c < 256; c++)
+        {
+            if (c < ' ' || c > '~')
+            {
+                order[n++] = c;
+            }
+        }
+    }
+    return order[r % k];
+}
+
+static const char *
+find_memmem(const struct pattern *pat, const char *hay, size_t n)
+{
+    return memmem(hay, n, pat->str, pat->len);
+}
+
+static const char *
+find_kernel(const struct pattern *pat, const char *hay, size_t n)
+{
+    return pattern_find(pat, hay, n);
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// every occurrence in buf, overlapping ones included, as sgrep's scan loops
+// find them
+static size_t
+find_all(find_fn find, const struct pattern *pat, const char *buf, size_t n)
+{
+    const char *p = buf;
+    const char *end = buf + n;
+    size_t count = 0;
+
+    while ((size_t)(end - p) >= pat->len)
+    {
+        p = find(pat, p, end - p);
+        if (p == NULL)
+        {
+            break;
+        }
+        count++;
+        p++;
+    }
+    return count;
+}
+
+// Positions of buf that pat's kernel verifies with a memcmp. Horspool
+// compares the windows it lands on whose last byte is the pattern's; the
+// others only those holding the pattern's two rarest bytes at their
+// offsets, which is also where the scalar kernel stops its memchr and
+// checks. A single byte is found by memchr alone.
+static size_t
+candidates(const struct pattern *pat, const char *buf, size_t n)
+{
+    size_t m = pat->len;
+    size_t count = 0;
+    size_t i;
+
+    if (m < 2 || n < m)
+    {
+        return find_all(find_kernel, pat, buf, n);
+    }
+    if (pat->find == horspool)
+    {
+        for (i = 0; i + m <= n; i += pat->skip[(unsigned char)buf[i + m - 1]])
+        {
+            count += buf[i + m - 1] == pat->str[m - 1];
+        }
+        return count;
+    }
+    for (i = 0; i + m <= n; i++)
+    {
+        count += buf[i + pat->rare1] == pat->str[pat->rare1] && buf[i + pat->rare2] == pat->str[pat->rare2];
+    }
+    return count;
+}
+
+// time one kernel, k being NULL for memmem, and print its line
+static void
+bench_one(const struct search_kernel *k, const char *str, size_t m, int alpha, size_t hits, const char *buf,
+          size_t n)
+{
+    struct pattern pat;
+    find_fn find = k != NULL ? find_kernel : find_memmem;
+    uint64_t best = UINT64_MAX;
+    size_t matches = 0, cands;
+    int run;
+
+    if (k != NULL)
+    {
+        search_select(k);
+    }
+    pattern_compile(&pat, str);
+
+    for (run = 0; run < BENCH_RUNS; run++)
+    {
+        uint64_t t0 = now_ns();
+        matches = find_all(find, &pat, buf, n);
+        uint64_t t = now_ns() - t0;
+        best = MU_MIN(best, t);
+    }
+
+    printf("%s\t%zu\t%d\t%zu\t%.4f\t%.2f\t%zu\t", k != NULL ? k->name : "memmem", m, alpha, hits,
+           (double)best / n, (double)n / best, matches);
+
+    // what memmem does inside is not ours to count
+    cands = k != NULL ? candidates(&pat, buf, n) : 0;
+    if (cands > 0)
+    {
+        printf("%.3f\t%.2f\n", cands * 1024.0 / n, 100.0 * matches / cands);
+    }
+    else
+    {
+        printf("%s\t-\n", k != NULL ? "0.000" : "-");
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    const struct search_kernel *const *kernels;
+    const struct search_kernel *chosen;
+    char str[257];
+    size_t n, i, li, ai, di;
+    long mb = 16;
+    char *buf;
+
+    if (argc > 2 || (argc == 2 && (mu_str_to_long(argv[1], 10, &mb) != 0 || mb <= 0)))
+    {
+        mu_die(USAGE);
+    }
+    n = (size_t)mb << 20;
+    buf = mu_malloc(n);
+
+    search_init();
+    chosen = search_kernel();
+    kernels = search_kernels();
+    for (i = 0; kernels[i] != NULL; i++)
+    {
+        if (strcmp(kernels[i]->name, "horspool") == 0)
+        {
+            horspool = kernels[i]->find;
+        }
+    }
+
+    printf("kernel\tpatlen\talphabet\thits_per_mib\tns_per_byte\tgbps\tmatches\tcands_per_kib\tverified_pct\n");
+    for (ai = 0; ai < NELEMS(alphabets); ai++)
+    {
+        int alpha = alphabets[ai];
+
+        for (li = 0; li < NELEMS(lengths); li++)
+        {
+            size_t m = lengths[li];
+
+            for (i = 0; i < m; i++)
+            {
+                str[i] = alpha_byte(alpha, rnd());
+            }
+            str[m] = '\0';
+
+            for (di = 0; di < NELEMS(densities); di++)
+            {
+                size_t hits = densities[di];
+
+                // a fresh buffer, with hits copies of the pattern planted
+                // at random in each MiB
+                for (i = 0; i < n; i++)
+                {
+                    buf[i] = alpha_byte(alpha, rnd());
+                }
+                for (i = 0; i < hits * (size_t)mb; i++)
+                {
+                    memcpy(buf + rnd() % (n - m), str, m);
+                }
+
+                for (size_t k = 0; kernels[k] != NULL; k++)
+                {
+                    bench_one(kernels[k], str, m, alpha, hits, buf, n);
+                }
+                bench_one(NULL, str, m, alpha, hits, buf, n);
+                fflush(stdout);
+            }
+        }
+    }
+
+    search_select(chosen);
+    free(buf);
+    return 0;
+}
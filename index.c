@@ -0,0 +1,1054 @@
+#define _GNU_SOURCE
+
+#include "index.h"
+#include "mu.h"
+#include "out.h"
+#include "reader.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// no block of the new index, for blocks of files that went away or changed
+#define NO_BLOCK UINT32_MAX
+
+// FNV-1a, for the names of the index and the blocks of files
+static uint64_t
+hash_bytes(const char *p, size_t n)
+{
+    uint64_t h = 14695981039346656037u;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        h = (h ^ (uint8_t)p[i]) * 1099511628211u;
+    }
+    return h;
+}
+
+// the next gap of a posting list that ends at end; a list cut short reads
+// as gaps past any block
+static uint64_t
+gap_read(const uint8_t **pp, const uint8_t *end)
+{
+    const uint8_t *p = *pp;
+    uint64_t gap = 0;
+    int shift = 0;
+
+    do
+    {
+        if (p == end || shift > 56)
+        {
+            *pp = end;
+            return UINT32_MAX;
+        }
+        gap |= (uint64_t)(*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    *pp = p;
+    return gap;
+}
+
+// the directory part of path with its slash, "" when there is none
+static char *
+path_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    size_t n = slash != NULL ? (size_t)(slash - path) + 1 : 0;
+    char *dir = mu_malloc(n + 1);
+
+    memcpy(dir, path, n);
+    dir[n] = '\0';
+    return dir;
+}
+
+static char *
+path_cat(const char *a, const char *b)
+{
+    size_t size = strlen(a) + strlen(b) + 1;
+    char *s = mu_malloc(size);
+
+    mu_snprintf(s, size, "%s%s", a, b);
+    return s;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// building
+
+// a posting list while it grows
+struct posting
+{
+    uint8_t *buf;
+    uint32_t len;
+    uint32_t cap;
+    uint32_t last; // the last block added plus one, 0 before any
+    uint32_t count;
+};
+
+struct builder
+{
+    struct index_file *files;
+    size_t nfiles;
+    size_t files_cap;
+    struct index_block *blocks;
+    size_t nblocks;
+    size_t blocks_cap;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+
+    // slot_of[t] is one more than the posting of trigram t, 0 when unseen
+    uint32_t *slot_of;
+    struct posting *posts;
+    size_t nposts;
+    size_t posts_cap;
+
+    // the index being written and the one it replaces are not indexed
+    struct stat skip[2];
+    int nskip;
+
+    // what the paths walked have in front of the names stored
+    size_t strip;
+
+    // refresh: the old index and the new number of each of its blocks that
+    // is kept
+    const struct index *old;
+    uint32_t *renumber;
+};
+
+static void
+posting_add(struct posting *p, uint32_t block)
+{
+    uint32_t gap;
+
+    if (p->last == block + 1)
+    {
+        return;
+    }
+    gap = p->last == 0 ? block : block - (p->last - 1);
+    p->last = block + 1;
+    p->count++;
+
+    if (p->cap - p->len < 5)
+    {
+        p->cap = p->cap ? p->cap * 2 : 16;
+        p->buf = mu_realloc(p->buf, p->cap);
+    }
+    while (gap >= 0x80)
+    {
+        p->buf[p->len++] = (uint8_t)(gap | 0x80);
+        gap >>= 7;
+    }
+    p->buf[p->len++] = (uint8_t)gap;
+}
+
+static struct posting *
+posting_of(struct builder *b, uint32_t t)
+{
+    uint32_t slot = b->slot_of[t];
+
+    if (slot == 0)
+    {
+        if (b->nposts == b->posts_cap)
+        {
+            b->posts_cap = b->posts_cap ? b->posts_cap * 2 : 4096;
+            b->posts = mu_reallocarray(b->posts, b->posts_cap, sizeof(*b->posts));
+        }
+        memset(&b->posts[b->nposts], 0, sizeof(*b->posts));
+        slot = ++b->nposts;
+        b->slot_of[t] = slot;
+    }
+    return &b->posts[slot - 1];
+}
+
+// add every trigram of [p, p + n) to the posting lists as seen in block
+static void
+block_trigrams(struct builder *b, const char *p, size_t n, uint32_t block)
+{
+    uint32_t t;
+    size_t i;
+
+    if (n < 3)
+    {
+        return;
+    }
+
+    t = (uint8_t)p[0] << 8 | (uint8_t)p[1];
+    for (i = 2; i < n; i++)
+    {
+        t = (t << 8 | (uint8_t)p[i]) & 0xffffff;
+        posting_add(posting_of(b, t), block);
+    }
+}
+
+static bool
+skipped(const struct builder *b, const struct stat *st)
+{
+    int i;
+
+    for (i = 0; i < b->nskip; i++)
+    {
+        if (b->skip[i].st_dev == st->st_dev && b->skip[i].st_ino == st->st_ino)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+name_add(struct builder *b, const char *s)
+{
+    size_t n = strlen(s) + 1;
+
+    if (b->names_cap - b->names_len < n)
+    {
+        b->names_cap = 2 * (b->names_cap + n);
+        b->names = mu_realloc(b->names, b->names_cap);
+    }
+    memcpy(b->names + b->names_len, s, n);
+    b->names_len += n;
+}
+
+static struct index_file *
+file_add(struct builder *b, const char *path, const struct stat *st)
+{
+    struct index_file *f;
+
+    if (b->nfiles == b->files_cap)
+    {
+        b->files_cap = b->files_cap ? b->files_cap * 2 : 256;
+        b->files = mu_reallocarray(b->files, b->files_cap, sizeof(*b->files));
+    }
+    f = &b->files[b->nfiles++];
+    memset(f, 0, sizeof(*f));
+    f->ino = st->st_ino;
+    f->mtime_sec = st->st_mtim.tv_sec;
+    f->mtime_nsec = st->st_mtim.tv_nsec;
+    f->ctime_sec = st->st_ctim.tv_sec;
+    f->ctime_nsec = st->st_ctim.tv_nsec;
+    f->size = (uint64_t)st->st_size;
+    f->block = b->nblocks;
+    f->name = b->names_len;
+    name_add(b, path + b->strip);
+    return f;
+}
+
+static void
+block_add(struct builder *b, uint64_t off, uint64_t line, uint64_t hash)
+{
+    if (b->nblocks == b->blocks_cap)
+    {
+        b->blocks_cap = b->blocks_cap ? b->blocks_cap * 2 : 1024;
+        b->blocks = mu_reallocarray(b->blocks, b->blocks_cap, sizeof(*b->blocks));
+    }
+    b->blocks[b->nblocks].off = off;
+    b->blocks[b->nblocks].line = line;
+    b->blocks[b->nblocks].hash = hash;
+    b->nblocks++;
+}
+
+// refresh: carry the first n blocks of the old file of over to f; their
+// postings follow in postings_merge
+static void
+blocks_keep(struct builder *b, struct index_file *f, const struct index_file *of, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        const struct index_block *ob = &b->old->blocks[of->block + i];
+        b->renumber[of->block + i] = b->nblocks;
+        block_add(b, ob->off, ob->line, ob->hash);
+        f->nblocks++;
+    }
+}
+
+// Index the regular file at path. On a refresh an unchanged file is taken
+// over from the old index without being opened. A changed one keeps the
+// run of leading blocks whose bytes hash as they did, short of its last
+// one, whose line may have been continued; the rest is indexed.
+static void
+file_index(struct builder *b, const char *path)
+{
+    const struct index_file *of;
+    struct index_file *f;
+    struct stat st;
+    const char *data = NULL;
+    size_t len, off = 0;
+    uint64_t line = 1;
+    uint32_t keep = 0;
+    int fd;
+
+    if (stat(path, &st) == -1)
+    {
+        mu_stderr_errno(errno, "sgrep: %s", path);
+        return;
+    }
+    if (!S_ISREG(st.st_mode) || skipped(b, &st))
+    {
+        return;
+    }
+
+    of = b->old != NULL ? index_find(b->old, path) : NULL;
+    if (of != NULL && index_fresh(of, &st))
+    {
+        f = file_add(b, path, &st);
+        f->flags = of->flags;
+        blocks_keep(b, f, of, of->nblocks);
+        return;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        mu_stderr_errno(errno, "sgrep: %s", path);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+    len = (size_t)st.st_size;
+    if (len > 0)
+    {
+        data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            mu_stderr_errno(errno, "sgrep: %s", path);
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+
+    f = file_add(b, path, &st);
+    f->flags = len > 0 && reader_compressed((const unsigned char *)data, len) ? INDEX_COMPRESSED : 0;
+    if (of != NULL)
+    {
+        const struct index_block *ob = &b->old->blocks[of->block];
+        while (keep + 1 < of->nblocks && ob[keep + 1].off <= len &&
+               hash_bytes(data + ob[keep].off, ob[keep + 1].off - ob[keep].off) == ob[keep].hash)
+        {
+            keep++;
+        }
+        if (keep > 0)
+        {
+            off = ob[keep].off;
+            line = ob[keep].line;
+        }
+    }
+    blocks_keep(b, f, of, keep);
+
+    if (len > 0)
+    {
+        madvise((void *)data, len, MADV_SEQUENTIAL);
+    }
+    while (off < len)
+    {
+        size_t end = MU_MIN(off + INDEX_BLOCK, len);
+        const char *nl = memchr(data + end - 1, '\n', len - end + 1);
+
+        end = nl != NULL ? (size_t)(nl - data) + 1 : len;
+        block_trigrams(b, data + off, end - off, b->nblocks);
+        block_add(b, off, line, hash_bytes(data + off, end - off));
+        f->nblocks++;
+        line += search_count_lines(data + off, end - off);
+        off = end;
+    }
+
+    if (len > 0)
+    {
+        munmap((void *)data, len);
+    }
+}
+
+// the files below dir, in the order -r searches them
+static void
+dir_index(struct builder *b, const char *dir)
+{
+    size_t dir_len = strlen(dir);
+    struct dirent *ent;
+    DIR *dh;
+
+    dh = opendir(dir);
+    if (dh == NULL)
+    {
+        mu_stderr_errno(errno, "sgrep: %s", dir);
+        return;
+    }
+
+    while ((ent = readdir(dh)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        size_t size = dir_len + strlen(ent->d_name) + 2;
+        char *path = mu_malloc(size);
+        bool slash = dir_len > 0 && dir[dir_len - 1] == '/';
+        mu_snprintf(path, size, "%s%s%s", dir, slash ? "" : "/", ent->d_name);
+
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            type = lstat(path, &st) == -1 ? DT_UNKNOWN : S_ISDIR(st.st_mode) ? DT_DIR
+                                                       : S_ISREG(st.st_mode) ? DT_REG
+                                                                             : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR)
+        {
+            dir_index(b, path);
+        }
+        else if (type == DT_REG)
+        {
+            file_index(b, path);
+        }
+        free(path);
+    }
+
+    closedir(dh);
+}
+
+static int
+block_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Refresh: add the kept blocks to the postings of the old index's trigrams.
+// New numbers follow the walk order, which may differ from the old one, so
+// the kept blocks of a list are sorted unless they came out ascending, then
+// merged with the blocks indexed anew.
+static void
+postings_merge(struct builder *b)
+{
+    const struct index *old = b->old;
+    uint32_t *ids = NULL;
+    size_t cap = 0;
+    uint64_t i;
+
+    for (i = 0; i < old->hdr->ntrigrams; i++)
+    {
+        const struct index_trigram *it = &old->tris[i];
+        const uint8_t *p = old->posts + it->post;
+        const uint8_t *end = old->posts + (old->hdr->names_off - old->hdr->posts_off);
+        uint64_t block = 0;
+        struct posting *np;
+        bool sorted = true;
+        size_t n = 0, m, j, k;
+
+        if (cap < it->count)
+        {
+            cap = 2 * it->count;
+            ids = mu_reallocarray(ids, cap, sizeof(*ids));
+        }
+        for (k = 0; k < it->count; k++)
+        {
+            block += gap_read(&p, end);
+            if (block < old->hdr->nblocks && b->renumber[block] != NO_BLOCK)
+            {
+                ids[n] = b->renumber[block];
+                sorted = sorted && (n == 0 || ids[n - 1] < ids[n]);
+                n++;
+            }
+        }
+        if (n == 0)
+        {
+            continue;
+        }
+        if (!sorted)
+        {
+            qsort(ids, n, sizeof(*ids), block_cmp);
+        }
+
+        np = posting_of(b, it->tri);
+        m = np->count;
+        if (cap < n + m)
+        {
+            cap = 2 * (n + m);
+            ids = mu_reallocarray(ids, cap, sizeof(*ids));
+        }
+        p = np->buf;
+        for (block = 0, k = n; k < n + m; k++)
+        {
+            block += gap_read(&p, np->buf + np->len);
+            ids[k] = (uint32_t)block;
+        }
+
+        np->len = 0;
+        np->last = 0;
+        np->count = 0;
+        for (j = 0, k = n; j < n || k < n + m;)
+        {
+            posting_add(np, k == n + m || (j < n && ids[j] < ids[k]) ? ids[j++] : ids[k++]);
+        }
+    }
+
+    free(ids);
+}
+
+static void
+index_write(struct builder *b, int fd)
+{
+    struct index_header h;
+    struct out o;
+    uint64_t post = 0;
+    uint32_t t;
+    int err;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.nfiles = b->nfiles;
+    h.nblocks = b->nblocks;
+    h.ntrigrams = b->nposts;
+    h.files_off = sizeof(h);
+    h.blocks_off = h.files_off + b->nfiles * sizeof(struct index_file);
+    h.tris_off = h.blocks_off + b->nblocks * sizeof(struct index_block);
+    h.posts_off = h.tris_off + b->nposts * sizeof(struct index_trigram);
+
+    out_init_fd(&o, fd);
+    out_write(&o, &h, sizeof(h));
+    out_write(&o, b->files, b->nfiles * sizeof(struct index_file));
+    out_write(&o, b->blocks, b->nblocks * sizeof(struct index_block));
+
+    // trigrams in ascending order, then their posting lists in the same order
+    for (t = 0; t < 1 << 24; t++)
+    {
+        if (b->slot_of[t] != 0)
+        {
+            const struct posting *p = &b->posts[b->slot_of[t] - 1];
+            struct index_trigram it = {t, p->count, post};
+            out_write(&o, &it, sizeof(it));
+            post += p->len;
+        }
+    }
+    for (t = 0; t < 1 << 24; t++)
+    {
+        if (b->slot_of[t] != 0)
+        {
+            const struct posting *p = &b->posts[b->slot_of[t] - 1];
+            out_write(&o, p->buf, p->len);
+        }
+    }
+
+    // the root was the first name added
+    h.names_off = h.posts_off + post;
+    h.root = 0;
+    h.size = h.names_off + b->names_len;
+    out_write(&o, b->names, b->names_len);
+    out_deinit(&o);
+
+    err = mu_pwrite_n(fd, &h, sizeof(h), 0, NULL);
+    if (err < 0)
+    {
+        mu_die_errno(-err, "write error");
+    }
+}
+
+// Index the files below root into path, taking what is still valid from
+// old when it is not NULL. A relative root is taken from the directory of
+// path, and the names are stored as the walk from there finds them.
+static int
+index_dir(const char *root, const char *path, const struct index *old)
+{
+    struct builder b;
+    struct stat st;
+    size_t size = strlen(path) + 5;
+    char *tmp = mu_malloc(size);
+    char *prefix = root[0] == '/' ? mu_strdup("") : path_dir(path);
+    char *dir = path_cat(prefix, root);
+    uint64_t i;
+    int fd;
+
+    memset(&b, 0, sizeof(b));
+    if (stat(dir, &st) == -1)
+    {
+        mu_die_errno(errno, "sgrep: %s", dir);
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        mu_die_errno(ENOTDIR, "sgrep: %s", dir);
+    }
+    b.strip = strlen(prefix);
+
+    // written next to the old index and renamed over it once complete
+    mu_snprintf(tmp, size, "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        mu_die_errno(errno, "sgrep: %s", tmp);
+    }
+    if (fstat(fd, &b.skip[b.nskip]) == 0)
+    {
+        b.nskip++;
+    }
+    if (stat(path, &b.skip[b.nskip]) == 0)
+    {
+        b.nskip++;
+    }
+
+    if (old != NULL)
+    {
+        b.old = old;
+        b.renumber = mu_mallocarray(old->hdr->nblocks + 1, sizeof(*b.renumber));
+        memset(b.renumber, 0xff, (old->hdr->nblocks + 1) * sizeof(*b.renumber));
+    }
+
+    b.slot_of = mu_calloc(1 << 24, sizeof(*b.slot_of));
+    name_add(&b, root);
+    dir_index(&b, dir);
+    if (old != NULL)
+    {
+        postings_merge(&b);
+    }
+    index_write(&b, fd);
+    close(fd);
+    if (rename(tmp, path) == -1)
+    {
+        mu_die_errno(errno, "sgrep: %s", path);
+    }
+
+    for (i = 0; i < b.nposts; i++)
+    {
+        free(b.posts[i].buf);
+    }
+    free(b.posts);
+    free(b.slot_of);
+    free(b.files);
+    free(b.blocks);
+    free(b.names);
+    free(b.renumber);
+    free(prefix);
+    free(dir);
+    free(tmp);
+    return 0;
+}
+
+// the canonical directory to, relative to the canonical directory from
+static char *
+path_relative(const char *from, const char *to)
+{
+    char *a = path_cat(from, strcmp(from, "/") == 0 ? "" : "/");
+    char *b = path_cat(to, strcmp(to, "/") == 0 ? "" : "/");
+    size_t common = 0, ups = 0, i, len;
+    char *rel;
+
+    // the whole components the two start with
+    for (i = 0; a[i] != '\0' && a[i] == b[i]; i++)
+    {
+        if (a[i] == '/')
+        {
+            common = i + 1;
+        }
+    }
+    for (i = common; a[i] != '\0'; i++)
+    {
+        ups += a[i] == '/';
+    }
+
+    len = 3 * ups + strlen(b + common);
+    rel = mu_malloc(len + 2);
+    for (i = 0; i < ups; i++)
+    {
+        memcpy(rel + 3 * i, "../", 3);
+    }
+    strcpy(rel + 3 * ups, b + common);
+    if (len == 0)
+    {
+        strcpy(rel, ".");
+    }
+    else
+    {
+        rel[len - 1] = '\0';
+    }
+
+    free(a);
+    free(b);
+    return rel;
+}
+
+int
+index_build(const char *dir, const char *path)
+{
+    char *index_dir_path, *from, *to, *root;
+    int status;
+
+    if (dir[0] == '/')
+    {
+        return index_dir(dir, path, NULL);
+    }
+
+    // a relative DIR is kept relative to where the index is
+    index_dir_path = path_dir(path);
+    from = realpath(index_dir_path[0] != '\0' ? index_dir_path : ".", NULL);
+    if (from == NULL)
+    {
+        mu_die_errno(errno, "sgrep: %s", index_dir_path);
+    }
+    to = realpath(dir, NULL);
+    if (to == NULL)
+    {
+        mu_die_errno(errno, "sgrep: %s", dir);
+    }
+    root = path_relative(from, to);
+    status = index_dir(root, path, NULL);
+
+    free(root);
+    free(to);
+    free(from);
+    free(index_dir_path);
+    return status;
+}
+
+int
+index_refresh(const char *path)
+{
+    struct index old;
+    char *root;
+    int status;
+
+    if (!index_open(&old, path))
+    {
+        return 1;
+    }
+    root = mu_strdup(old.names + old.hdr->root);
+    status = index_dir(root, path, &old);
+    index_close(&old);
+    free(root);
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// querying
+
+// is the table of n entries of size bytes at off within a mapping of len
+// bytes, and aligned for them
+static bool
+table_fits(uint64_t off, uint64_t n, size_t size, size_t len)
+{
+    return off <= len && off % 8 == 0 && n <= (len - off) / size;
+}
+
+// Is the mapped index whole: every table, name, block and posting list
+// within it where the header and the tables say. The files' blocks must
+// start at 0 and ascend within their files, as they were cut.
+static bool
+index_valid(const struct index *ix)
+{
+    const struct index_header *h = ix->hdr;
+    uint64_t i, b;
+
+    if (!table_fits(h->files_off, h->nfiles, sizeof(struct index_file), ix->len) ||
+        !table_fits(h->blocks_off, h->nblocks, sizeof(struct index_block), ix->len) ||
+        !table_fits(h->tris_off, h->ntrigrams, sizeof(struct index_trigram), ix->len) || h->posts_off > h->names_off ||
+        h->names_off >= ix->len || ix->map[ix->len - 1] != '\0' || h->root >= ix->len - h->names_off ||
+        h->nblocks >= UINT32_MAX)
+    {
+        return false;
+    }
+
+    for (i = 0; i < h->nfiles; i++)
+    {
+        const struct index_file *f = &ix->files[i];
+
+        if (f->name >= ix->names_len || f->block > h->nblocks || f->nblocks > h->nblocks - f->block)
+        {
+            return false;
+        }
+        for (b = f->block; b < (uint64_t)f->block + f->nblocks; b++)
+        {
+            if (ix->blocks[b].off >= f->size || (b == f->block ? ix->blocks[b].off != 0
+                                                                : ix->blocks[b].off <= ix->blocks[b - 1].off))
+            {
+                return false;
+            }
+        }
+    }
+
+    // every gap takes a byte at least
+    for (i = 0; i < h->ntrigrams; i++)
+    {
+        if (ix->tris[i].post > h->names_off - h->posts_off ||
+            ix->tris[i].count > h->names_off - h->posts_off - ix->tris[i].post)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+index_open(struct index *ix, const char *path)
+{
+    const struct index_header *h;
+    struct stat st;
+    size_t cap;
+    uint64_t i;
+    int fd;
+
+    memset(ix, 0, sizeof(*ix));
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        mu_stderr_errno(errno, "sgrep: %s", path);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    ix->len = (size_t)st.st_size;
+    ix->map = ix->len < sizeof(*h) ? MAP_FAILED : mmap(NULL, ix->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    h = (const struct index_header *)ix->map;
+    if (ix->map == MAP_FAILED || memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 || h->size != ix->len)
+    {
+        mu_stderr("sgrep: %s: not an sgrep index", path);
+        if (ix->map != MAP_FAILED)
+        {
+            munmap(ix->map, ix->len);
+        }
+        return false;
+    }
+    ix->hdr = h;
+    ix->files = (const struct index_file *)(ix->map + h->files_off);
+    ix->blocks = (const struct index_block *)(ix->map + h->blocks_off);
+    ix->tris = (const struct index_trigram *)(ix->map + h->tris_off);
+    ix->posts = (const uint8_t *)(ix->map + h->posts_off);
+    ix->names = ix->map + h->names_off;
+    ix->names_len = ix->len - h->names_off;
+    if (!index_valid(ix))
+    {
+        mu_stderr("sgrep: %s: index is damaged", path);
+        munmap(ix->map, ix->len);
+        return false;
+    }
+
+    // names relative to the index's directory are opened through it
+    ix->prefix = ix->names[h->root] == '/' ? mu_strdup("") : path_dir(path);
+
+    for (cap = 16; cap < 2 * h->nfiles; cap *= 2)
+    {
+    }
+    ix->by_name = mu_calloc(cap, sizeof(*ix->by_name));
+    ix->by_name_mask = cap - 1;
+    for (i = 0; i < h->nfiles; i++)
+    {
+        const char *name = index_name(ix, &ix->files[i]);
+        size_t slot = hash_bytes(name, strlen(name)) & ix->by_name_mask;
+        while (ix->by_name[slot] != 0)
+        {
+            slot = (slot + 1) & ix->by_name_mask;
+        }
+        ix->by_name[slot] = i + 1;
+    }
+    return true;
+}
+
+void
+index_close(struct index *ix)
+{
+    munmap(ix->map, ix->len);
+    free(ix->prefix);
+    free(ix->by_name);
+}
+
+char *
+index_path(const struct index *ix, const char *name)
+{
+    return path_cat(ix->prefix, name);
+}
+
+const struct index_file *
+index_find(const struct index *ix, const char *path)
+{
+    size_t n = strlen(ix->prefix);
+    size_t slot;
+
+    if (strncmp(path, ix->prefix, n) != 0)
+    {
+        return NULL;
+    }
+    path += n;
+    for (slot = hash_bytes(path, strlen(path)) & ix->by_name_mask; ix->by_name[slot] != 0;
+         slot = (slot + 1) & ix->by_name_mask)
+    {
+        const struct index_file *f = &ix->files[ix->by_name[slot] - 1];
+        if (strcmp(index_name(ix, f), path) == 0)
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+bool
+index_fresh(const struct index_file *f, const struct stat *st)
+{
+    return f->ino == (uint64_t)st->st_ino && f->mtime_sec == st->st_mtim.tv_sec &&
+           f->mtime_nsec == st->st_mtim.tv_nsec && f->ctime_sec == st->st_ctim.tv_sec &&
+           f->ctime_nsec == st->st_ctim.tv_nsec && f->size == (uint64_t)st->st_size;
+}
+
+static const struct index_trigram *
+trigram_find(const struct index *ix, uint32_t t)
+{
+    size_t lo = 0;
+    size_t hi = ix->hdr->ntrigrams;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ix->tris[mid].tri < t)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo < ix->hdr->ntrigrams && ix->tris[lo].tri == t ? &ix->tris[lo] : NULL;
+}
+
+// Set cand for the blocks holding every trigram of the literal s, at most
+// INDEX_MAX_TRIGRAMS of them. hits is scratch space of one byte per block and
+// touched of one block number per block; hits is all zero on entry and left so.
+static void
+literal_candidates(const struct index *ix, const char *s, size_t len, uint8_t *cand, uint8_t *hits,
+                   uint32_t *touched)
+{
+    const struct index_trigram *its[INDEX_MAX_TRIGRAMS];
+    const uint8_t *end = ix->posts + (ix->hdr->names_off - ix->hdr->posts_off);
+    size_t n = 0, ntouched = 0;
+    size_t i, j;
+
+    for (i = 0; i + 2 < len && n < INDEX_MAX_TRIGRAMS; i++)
+    {
+        uint32_t t = (uint8_t)s[i] << 16 | (uint8_t)s[i + 1] << 8 | (uint8_t)s[i + 2];
+        const struct index_trigram *it = trigram_find(ix, t);
+
+        // a trigram found nowhere rules out the literal everywhere
+        if (it == NULL)
+        {
+            return;
+        }
+        for (j = 0; j < n && its[j] != it; j++)
+        {
+        }
+        if (j == n)
+        {
+            its[n++] = it;
+        }
+    }
+
+    // the shortest posting list bounds the candidates, so it goes first
+    for (i = 1; i < n; i++)
+    {
+        if (its[i]->count < its[0]->count)
+        {
+            const struct index_trigram *it = its[0];
+
+            its[0] = its[i];
+            its[i] = it;
+        }
+    }
+
+    // a block's hits counts the lists seen so far that hold it, up to the
+    // first one that does not
+    for (i = 0; i < n; i++)
+    {
+        const uint8_t *p = ix->posts + its[i]->post;
+        uint64_t block = 0;
+        uint32_t k;
+
+        for (k = 0; k < its[i]->count; k++)
+        {
+            block += gap_read(&p, end);
+            if (block < ix->hdr->nblocks && hits[block] == i)
+            {
+                if (i == 0)
+                {
+                    touched[ntouched++] = block;
+                }
+                hits[block]++;
+            }
+        }
+    }
+
+    for (i = 0; i < ntouched; i++)
+    {
+        cand[touched[i]] |= hits[touched[i]] == n;
+        hits[touched[i]] = 0;
+    }
+}
+
+bool
+index_candidates(const struct index *ix, const struct matcher *mt, uint8_t *cand)
+{
+    enum matcher_kind kind = mt->kind == MATCHER_REGEX ? mt->pre : mt->kind;
+    uint8_t *hits;
+    uint32_t *touched;
+    size_t i;
+
+    // every match holds one of the literals, none shorter than a trigram
+    switch (kind)
+    {
+    case MATCHER_NONE:
+        if (mt->kind == MATCHER_REGEX)
+        {
+            return false;
+        }
+        return true;
+    case MATCHER_LITERAL:
+        if (mt->lit.len < 3)
+        {
+            return false;
+        }
+        break;
+    case MATCHER_MULTI:
+        for (i = 0; i < mt->multi.npats; i++)
+        {
+            if (mt->multi.lens[i] < 3)
+            {
+                return false;
+            }
+        }
+        break;
+    default:
+        return false;
+    }
+
+    hits = mu_zalloc(ix->hdr->nblocks + 1);
+    touched = mu_mallocarray(ix->hdr->nblocks + 1, sizeof(*touched));
+    if (kind == MATCHER_LITERAL)
+    {
+        literal_candidates(ix, mt->lit.str, mt->lit.len, cand, hits, touched);
+    }
+    else
+    {
+        for (i = 0; i < mt->multi.npats; i++)
+        {
+            literal_candidates(ix, mt->multi.pats[i], mt->multi.lens[i], cand, hits, touched);
+        }
+    }
+    free(touched);
+    free(hits);
+    return true;
+}
@@ -0,0 +1,132 @@
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "matcher.h"
+
+// A trigram index over the regular files below a directory, written by
+// "sgrep index build" and mapped as is by --index. Every file is cut into
+// blocks of whole lines, and each trigram that occurs in the index has a
+// posting list of the blocks holding it. All integers are native endian.
+// File names, and DIR itself unless it was given as an absolute path, are
+// relative to the directory holding the index, so queries find the files
+// from any working directory.
+//
+// "sgrep index refresh" rewrites it from the old one: files whose inode,
+// mtime, ctime and size are unchanged keep their blocks and postings without
+// being read. Any other file is read, and keeps the leading blocks whose
+// bytes still hash as they did, all but its last one at most; what follows
+// is indexed again, which for a file that was only appended to is its last
+// block and the new bytes.
+
+#define INDEX_MAGIC "SGRIDX04"
+
+// path of the index when none is given
+#define INDEX_DEFAULT "sgrep.idx"
+
+// blocks are this long, plus the rest of the line they end in
+#define INDEX_BLOCK (256 * 1024)
+
+// trigrams of a literal intersected at most
+#define INDEX_MAX_TRIGRAMS 32
+
+struct index_header
+{
+    char magic[8];
+    uint64_t nfiles;
+    uint64_t nblocks;
+    uint64_t ntrigrams;
+    uint64_t files_off;  // struct index_file[nfiles], in -r walk order
+    uint64_t blocks_off; // struct index_block[nblocks]
+    uint64_t tris_off;   // struct index_trigram[ntrigrams], ascending
+    uint64_t posts_off;  // posting lists
+    uint64_t names_off;  // NUL terminated paths
+    uint64_t root;       // offset in names of the DIR the index was built from
+    uint64_t size;       // of the whole index
+};
+
+// the file was gzip or zstd when indexed; with -z it is searched in full
+#define INDEX_COMPRESSED 0x1
+
+struct index_file
+{
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;     // bytes indexed
+    uint64_t name;     // offset of the path in names
+    uint32_t block;    // first block
+    uint32_t nblocks;
+    uint32_t flags;
+    uint32_t pad;
+    int64_t ctime_sec; // which no rewrite can set back, unlike the mtime
+    int64_t ctime_nsec;
+};
+
+struct index_block
+{
+    uint64_t off;  // where the block starts in its file, always a line start
+    uint64_t line; // number of the line starting there
+    uint64_t hash; // of the block's bytes, to tell what a refresh can keep
+};
+
+struct index_trigram
+{
+    uint32_t tri;   // three bytes, the first one highest
+    uint32_t count; // blocks in the posting list
+    uint64_t post;  // offset of the posting list in posts: the ascending
+                    // block numbers as LEB128 gaps, the first from 0
+};
+
+// an index mapped for querying
+struct index
+{
+    char *map;
+    size_t len;
+    const struct index_header *hdr;
+    const struct index_file *files;
+    const struct index_block *blocks;
+    const struct index_trigram *tris;
+    const uint8_t *posts;
+    const char *names;
+    size_t names_len;
+    char *prefix;      // put in front of a name to open it, "" for absolute names
+    uint32_t *by_name; // open addressing on the name's hash, each slot one more than the file
+    size_t by_name_mask;
+};
+
+// "sgrep index build DIR [INDEX]" and "sgrep index refresh [INDEX]";
+// both return the exit status
+int index_build(const char *dir, const char *path);
+int index_refresh(const char *path);
+
+// map the index at path; returns false, having said why, when it is not one
+// or is damaged
+bool index_open(struct index *ix, const char *path);
+void index_close(struct index *ix);
+
+static inline const char *
+index_name(const struct index *ix, const struct index_file *f)
+{
+    return ix->names + f->name;
+}
+
+// the path name of the index refers to from the working directory
+char *index_path(const struct index *ix, const char *name);
+
+// the file that was indexed at path, a path as index_path gives them, or NULL
+const struct index_file *index_find(const struct index *ix, const char *path);
+
+// is the file f as stat found it still the file that was indexed
+bool index_fresh(const struct index_file *f, const struct stat *st);
+
+// Set cand[b] for every block b that may hold a match of mt. Returns false,
+// leaving cand alone, when the patterns have no trigrams to narrow with.
+bool index_candidates(const struct index *ix, const struct matcher *mt, uint8_t *cand);
+
+#endif /* _INDEX_H_ */
@@ -0,0 +1,140 @@
+#include "matcher.h"
+
+#include "mu.h"
+
+#include <string.h>
+
+static void
+regex_prefilter(struct matcher *mt)
+{
+    const char *engine = "lazy-dfa";
+
+    mt->pre = MATCHER_NONE;
+    if (mt->re.nlits == 1)
+    {
+        mt->pre = MATCHER_LITERAL;
+        pattern_compile(&mt->lit, mt->re.lits[0]);
+        engine = search_kernel()->name;
+    }
+    else if (mt->re.nlits > 1)
+    {
+        mt->pre = MATCHER_MULTI;
+        multi_compile(&mt->multi, mt->re.lits, mt->re.nlits);
+        engine = mt->multi.name;
+    }
+
+    mu_snprintf(mt->name, sizeof(mt->name), mt->pre == MATCHER_NONE ? "%s" : "lazy-dfa+%s", engine);
+}
+
+bool
+matcher_compile(struct matcher *mt, char **pats, size_t npats, bool extended)
+{
+    size_t i;
+
+    memset(mt, 0, sizeof(*mt));
+    if (npats == 0)
+    {
+        mt->kind = MATCHER_NONE;
+        return true;
+    }
+
+    if (extended)
+    {
+        mt->kind = MATCHER_REGEX;
+        if (!regex_compile(&mt->re, pats, npats))
+        {
+            mt->kind = MATCHER_NONE;
+            return false;
+        }
+        regex_prefilter(mt);
+        return true;
+    }
+
+    // an empty pattern matches every line, which the literal search of ""
+    // already does, whatever else is in the set
+    for (i = 0; i < npats; i++)
+    {
+        if (pats[i][0] == '\0')
+        {
+            mt->kind = MATCHER_LITERAL;
+            pattern_compile(&mt->lit, pats[i]);
+            return true;
+        }
+    }
+
+    if (npats == 1)
+    {
+        mt->kind = MATCHER_LITERAL;
+        pattern_compile(&mt->lit, pats[0]);
+        return true;
+    }
+
+    mt->kind = MATCHER_MULTI;
+    multi_compile(&mt->multi, pats, npats);
+    return true;
+}
+
+void
+matcher_free(struct matcher *mt)
+{
+    if (mt->kind == MATCHER_MULTI || (mt->kind == MATCHER_REGEX && mt->pre == MATCHER_MULTI))
+    {
+        multi_free(&mt->multi);
+    }
+    if (mt->kind == MATCHER_REGEX)
+    {
+        regex_free(&mt->re);
+    }
+}
+
+const char *
+matcher_name(const struct matcher *mt)
+{
+    switch (mt->kind)
+    {
+    case MATCHER_LITERAL:
+        return search_kernel()->name;
+    case MATCHER_MULTI:
+        return mt->multi.name;
+    case MATCHER_REGEX:
+        return mt->name;
+    default:
+        return "none";
+    }
+}
+
+const char *
+matcher_find(const struct matcher *mt, const char *hay, size_t n, size_t *len)
+{
+    size_t dummy;
+
+    if (len == NULL)
+    {
+        len = &dummy;
+    }
+
+    switch (mt->kind == MATCHER_REGEX ? mt->pre : mt->kind)
+    {
+    case MATCHER_NONE:
+        // a regex without literals: every line is a candidate
+        *len = 0;
+        return mt->kind == MATCHER_REGEX ? hay : NULL;
+    case MATCHER_LITERAL:
+        *len = mt->lit.len;
+        return pattern_find(&mt->lit, hay, n);
+    case MATCHER_MULTI:
+        return multi_find(&mt->multi, hay, n, len);
+    default:
+        return NULL;
+    }
+}
+
+bool
+matcher_line(const struct matcher *mt, const char *ls, const char *le)
+{
+    if (matcher_find(mt, ls, le - ls, NULL) == NULL)
+    {
+        return false;
+    }
+    return mt->kind != MATCHER_REGEX || regex_match_line(&mt->re, ls, le);
+}
@@ -0,0 +1,50 @@
+#ifndef _MATCHER_H_
+#define _MATCHER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "multi.h"
+#include "regex.h"
+#include "search.h"
+
+enum matcher_kind
+{
+    MATCHER_NONE,    // no patterns at all, nothing matches
+    MATCHER_LITERAL, // one pattern, searched with the substring kernels
+    MATCHER_MULTI,   // several patterns, Teddy or Aho-Corasick
+    MATCHER_REGEX,   // extended regular expressions, a lazy DFA
+};
+
+// the compiled form of every pattern given for a run
+struct matcher
+{
+    enum matcher_kind kind;
+    struct pattern lit;
+    struct multi multi;
+
+    // for MATCHER_REGEX lit or multi hold the literals every match contains
+    // and pre says which, MATCHER_NONE when there are none to search for
+    struct regex re;
+    enum matcher_kind pre;
+    char name[32];
+};
+
+// pats must outlive the matcher; extended compiles them as regular
+// expressions rather than fixed strings. Returns false, with nothing to
+// free, when a regular expression does not parse.
+bool matcher_compile(struct matcher *mt, char **pats, size_t npats, bool extended);
+void matcher_free(struct matcher *mt);
+
+// name of the search engine picked for the patterns
+const char *matcher_name(const struct matcher *mt);
+
+// returns the start of the first match in hay[0..n) and, when len is not
+// NULL, stores its length; for a regex this is only a candidate, the first
+// hit of its prefilter, and the line still needs matcher_line
+const char *matcher_find(const struct matcher *mt, const char *hay, size_t n, size_t *len);
+
+// does the line [ls, le) match, le may include the newline
+bool matcher_line(const struct matcher *mt, const char *ls, const char *le);
+
+#endif /* _MATCHER_H_ */
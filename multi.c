@@ -0,0 +1,413 @@
+#include "mu.h"
+#include "multi.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define NO_STATE UINT32_MAX
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Aho-Corasick. The trie is built straight into a flat transition table with
+// one row per state and one column per byte class, where every byte that
+// occurs in no pattern shares class 0. Failure links are then folded into
+// the table breadth first, turning it into a DFA that takes exactly one load
+// per input byte.
+
+static uint32_t
+ac_new_state(struct multi *mp, size_t *cap)
+{
+    uint32_t i;
+
+    if (mp->nstates == *cap)
+    {
+        *cap *= 2;
+        mp->trans = mu_reallocarray(mp->trans, *cap * mp->stride, sizeof(*mp->trans));
+        mp->out_len = mu_reallocarray(mp->out_len, *cap, sizeof(*mp->out_len));
+    }
+    for (i = 0; i < mp->stride; i++)
+    {
+        mp->trans[mp->nstates * mp->stride + i] = NO_STATE;
+    }
+    mp->out_len[mp->nstates] = 0;
+
+    return mp->nstates++;
+}
+
+static void
+ac_build(struct multi *mp)
+{
+    size_t cap = 256;
+    uint32_t *queue, *fail, *perm, *trans;
+    size_t qhead = 0, qtail = 0;
+    size_t i, j;
+    uint32_t s, c, nclasses = 1;
+
+    // byte classes
+    memset(mp->classes, 0, sizeof(mp->classes));
+    for (i = 0; i < mp->npats; i++)
+    {
+        for (j = 0; j < mp->lens[i]; j++)
+        {
+            unsigned char b = mp->pats[i][j];
+            if (mp->classes[b] == 0)
+            {
+                mp->classes[b] = nclasses++;
+            }
+        }
+    }
+    mp->stride = nclasses;
+
+    // trie
+    mp->nstates = 0;
+    mp->trans = mu_mallocarray(cap * mp->stride, sizeof(*mp->trans));
+    mp->out_len = mu_mallocarray(cap, sizeof(*mp->out_len));
+    ac_new_state(mp, &cap);
+    for (i = 0; i < mp->npats; i++)
+    {
+        s = 0;
+        for (j = 0; j < mp->lens[i]; j++)
+        {
+            c = mp->classes[(unsigned char)mp->pats[i][j]];
+            if (mp->trans[s * mp->stride + c] == NO_STATE)
+            {
+                uint32_t t = ac_new_state(mp, &cap);
+                mp->trans[s * mp->stride + c] = t;
+            }
+            s = mp->trans[s * mp->stride + c];
+        }
+        if (mp->out_len[s] == 0 || mp->lens[i] < mp->out_len[s])
+        {
+            mp->out_len[s] = mp->lens[i];
+        }
+    }
+
+    // failure links, breadth first so a state's link is final before its
+    // children need it
+    queue = mu_mallocarray(mp->nstates, sizeof(*queue));
+    fail = mu_mallocarray(mp->nstates, sizeof(*fail));
+    fail[0] = 0;
+    for (c = 0; c < mp->stride; c++)
+    {
+        uint32_t t = mp->trans[c];
+        if (t == NO_STATE)
+        {
+            mp->trans[c] = 0;
+        }
+        else
+        {
+            fail[t] = 0;
+            queue[qtail++] = t;
+        }
+    }
+    while (qhead < qtail)
+    {
+        s = queue[qhead++];
+        // a state also accepts every pattern its failure link accepts
+        uint32_t f_len = mp->out_len[fail[s]];
+        if (f_len != 0 && (mp->out_len[s] == 0 || f_len < mp->out_len[s]))
+        {
+            mp->out_len[s] = f_len;
+        }
+        for (c = 0; c < mp->stride; c++)
+        {
+            uint32_t t = mp->trans[s * mp->stride + c];
+            uint32_t f = mp->trans[fail[s] * mp->stride + c];
+            if (t == NO_STATE)
+            {
+                mp->trans[s * mp->stride + c] = f;
+            }
+            else
+            {
+                fail[t] = f;
+                queue[qtail++] = t;
+            }
+        }
+    }
+
+    // renumber so the accepting states come first, and premultiply ids
+    perm = mu_mallocarray(mp->nstates, sizeof(*perm));
+    j = 0;
+    for (i = 0; i < mp->nstates; i++)
+    {
+        if (mp->out_len[i] != 0)
+        {
+            perm[i] = j++;
+        }
+    }
+    mp->acc_limit = j * mp->stride;
+    for (i = 0; i < mp->nstates; i++)
+    {
+        if (mp->out_len[i] == 0)
+        {
+            perm[i] = j++;
+        }
+    }
+
+    trans = mu_mallocarray(mp->nstates * mp->stride, sizeof(*trans));
+    for (i = 0; i < mp->nstates; i++)
+    {
+        for (c = 0; c < mp->stride; c++)
+        {
+            trans[perm[i] * mp->stride + c] = perm[mp->trans[i * mp->stride + c]] * mp->stride;
+        }
+        queue[perm[i]] = mp->out_len[i];
+    }
+    memcpy(mp->out_len, queue, mp->nstates * sizeof(*mp->out_len));
+    free(mp->trans);
+    mp->trans = trans;
+    mp->start = perm[0] * mp->stride;
+
+    free(perm);
+    free(fail);
+    free(queue);
+}
+
+static const char *
+find_ac(const struct multi *mp, const char *hay, size_t n, size_t *len)
+{
+    const uint32_t *trans = mp->trans;
+    uint32_t s = mp->start;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        s = trans[s + mp->classes[(unsigned char)hay[i]]];
+        if (s < mp->acc_limit)
+        {
+            *len = mp->out_len[s / mp->stride];
+            return hay + i + 1 - *len;
+        }
+    }
+
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Teddy. Patterns are spread over 8 buckets and the first teddy_len bytes of
+// every pattern are folded into per offset nibble tables. pshufb looks up a
+// whole block of input nibbles at once; ANDing the low and high nibble
+// results of each offset leaves, per input position, the buckets holding a
+// pattern that may start there. Only those patterns are compared in full.
+
+// compare the patterns of the buckets in mask against the input at pos
+static bool
+teddy_verify(const struct multi *mp, const char *hay, size_t n, size_t pos, unsigned mask, size_t *len)
+{
+    while (mask != 0)
+    {
+        unsigned b = __builtin_ctz(mask);
+        size_t i;
+
+        for (i = 0; i < mp->bucket_n[b]; i++)
+        {
+            size_t k = mp->bucket[b][i];
+            if (pos + mp->lens[k] <= n && memcmp(hay + pos, mp->pats[k], mp->lens[k]) == 0)
+            {
+                *len = mp->lens[k];
+                return true;
+            }
+        }
+        mask &= mask - 1;
+    }
+
+    return false;
+}
+
+// positions too close to the end for a full block
+static const char *
+teddy_tail(const struct multi *mp, const char *hay, size_t n, size_t pos, size_t *len)
+{
+    for (; pos < n; pos++)
+    {
+        if (teddy_verify(mp, hay, n, pos, (1u << TEDDY_BUCKETS) - 1, len))
+        {
+            return hay + pos;
+        }
+    }
+
+    return NULL;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("ssse3"))) static const char *
+find_teddy_ssse3(const struct multi *mp, const char *hay, size_t n, size_t *len)
+{
+    const __m128i nib = _mm_set1_epi8(0x0f);
+    __m128i lo[TEDDY_MAX_LEN], hi[TEDDY_MAX_LEN];
+    uint8_t res[16];
+    size_t k = mp->teddy_len;
+    size_t i, j;
+
+    for (j = 0; j < k; j++)
+    {
+        lo[j] = _mm_loadu_si128((const __m128i *)mp->lo[j]);
+        hi[j] = _mm_loadu_si128((const __m128i *)mp->hi[j]);
+    }
+
+    for (i = 0; i + k - 1 + 16 <= n; i += 16)
+    {
+        __m128i acc = _mm_set1_epi8((char)0xff);
+        for (j = 0; j < k; j++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(hay + i + j));
+            __m128i l = _mm_shuffle_epi8(lo[j], _mm_and_si128(v, nib));
+            __m128i h = _mm_shuffle_epi8(hi[j], _mm_and_si128(_mm_srli_epi16(v, 4), nib));
+            acc = _mm_and_si128(acc, _mm_and_si128(l, h));
+        }
+
+        unsigned cand = ~_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) & 0xffff;
+        if (cand == 0)
+        {
+            continue;
+        }
+        _mm_storeu_si128((__m128i *)res, acc);
+        while (cand != 0)
+        {
+            unsigned t = __builtin_ctz(cand);
+            if (teddy_verify(mp, hay, n, i + t, res[t], len))
+            {
+                return hay + i + t;
+            }
+            cand &= cand - 1;
+        }
+    }
+
+    return teddy_tail(mp, hay, n, i, len);
+}
+
+__attribute__((target("avx2"))) static const char *
+find_teddy_avx2(const struct multi *mp, const char *hay, size_t n, size_t *len)
+{
+    const __m256i nib = _mm256_set1_epi8(0x0f);
+    __m256i lo[TEDDY_MAX_LEN], hi[TEDDY_MAX_LEN];
+    uint8_t res[32];
+    size_t k = mp->teddy_len;
+    size_t i, j;
+
+    // vpshufb looks up within each 128 bit lane, so both lanes get the table
+    for (j = 0; j < k; j++)
+    {
+        lo[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)mp->lo[j]));
+        hi[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)mp->hi[j]));
+    }
+
+    for (i = 0; i + k - 1 + 32 <= n; i += 32)
+    {
+        __m256i acc = _mm256_set1_epi8((char)0xff);
+        for (j = 0; j < k; j++)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(hay + i + j));
+            __m256i l = _mm256_shuffle_epi8(lo[j], _mm256_and_si256(v, nib));
+            __m256i h = _mm256_shuffle_epi8(hi[j], _mm256_and_si256(_mm256_srli_epi16(v, 4), nib));
+            acc = _mm256_and_si256(acc, _mm256_and_si256(l, h));
+        }
+
+        uint32_t cand = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(acc, _mm256_setzero_si256()));
+        if (cand == 0)
+        {
+            continue;
+        }
+        _mm256_storeu_si256((__m256i *)res, acc);
+        while (cand != 0)
+        {
+            unsigned t = __builtin_ctz(cand);
+            if (teddy_verify(mp, hay, n, i + t, res[t], len))
+            {
+                return hay + i + t;
+            }
+            cand &= cand - 1;
+        }
+    }
+
+    return teddy_tail(mp, hay, n, i, len);
+}
+
+#endif /* __x86_64__ */
+
+static void
+teddy_build(struct multi *mp)
+{
+    size_t i, j;
+
+    mp->teddy_len = TEDDY_MAX_LEN;
+    for (i = 0; i < mp->npats; i++)
+    {
+        mp->teddy_len = MU_MIN(mp->teddy_len, mp->lens[i]);
+    }
+
+    memset(mp->lo, 0, sizeof(mp->lo));
+    memset(mp->hi, 0, sizeof(mp->hi));
+    memset(mp->bucket_n, 0, sizeof(mp->bucket_n));
+    for (i = 0; i < mp->npats; i++)
+    {
+        size_t b = i % TEDDY_BUCKETS;
+
+        mp->bucket[b][mp->bucket_n[b]++] = i;
+        for (j = 0; j < mp->teddy_len; j++)
+        {
+            unsigned char c = mp->pats[i][j];
+            mp->lo[j][c & 0x0f] |= 1u << b;
+            mp->hi[j][c >> 4] |= 1u << b;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void
+multi_compile(struct multi *mp, char **pats, size_t npats)
+{
+    size_t i;
+
+    memset(mp, 0, sizeof(*mp));
+    mp->npats = npats;
+    mp->pats = pats;
+    mp->lens = mu_mallocarray(npats, sizeof(*mp->lens));
+    for (i = 0; i < npats; i++)
+    {
+        mp->lens[i] = strlen(pats[i]);
+    }
+
+    mp->name = "aho-corasick";
+    mp->find = find_ac;
+
+#if defined(__x86_64__)
+    if (npats <= TEDDY_MAX_PATTERNS && __builtin_cpu_supports("ssse3"))
+    {
+        teddy_build(mp);
+        mp->name = "teddy-ssse3";
+        mp->find = find_teddy_ssse3;
+        if (__builtin_cpu_supports("avx2"))
+        {
+            mp->name = "teddy-avx2";
+            mp->find = find_teddy_avx2;
+        }
+        return;
+    }
+#endif
+
+    ac_build(mp);
+}
+
+void
+multi_free(struct multi *mp)
+{
+    free(mp->lens);
+    free(mp->trans);
+    free(mp->out_len);
+}
+
+const char *
+multi_find(const struct multi *mp, const char *hay, size_t n, size_t *len)
+{
+    return mp->find(mp, hay, n, len);
+}
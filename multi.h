@@ -0,0 +1,55 @@
+#ifndef _MULTI_H_
+#define _MULTI_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// sets of at most this many patterns are searched with Teddy when the CPU
+// has SSSE3, bigger ones go straight to the Aho-Corasick automaton
+#define TEDDY_MAX_PATTERNS 32
+#define TEDDY_BUCKETS 8
+#define TEDDY_MAX_LEN 3
+
+struct multi;
+
+// returns the start of the first match in hay[0..n) and stores its length
+typedef const char *(*multi_fn)(const struct multi *mp, const char *hay, size_t n, size_t *len);
+
+// a set of literal patterns searched in one pass
+struct multi
+{
+    size_t npats;
+    char **pats;
+    size_t *lens;
+
+    // Aho-Corasick DFA over byte classes: trans holds stride entries per
+    // state, state ids are premultiplied by stride and accepting states are
+    // numbered first, so a match is any state below acc_limit
+    uint8_t classes[256];
+    uint32_t stride;
+    uint32_t *trans;
+    uint32_t start;
+    uint32_t acc_limit;
+    uint32_t *out_len; // shortest pattern ending in each state
+    size_t nstates;
+
+    // Teddy: bit b of lo[j][x] (hi[j][x]) is set when some pattern in bucket
+    // b has low (high) nibble x at offset j
+    size_t teddy_len;
+    uint8_t lo[TEDDY_MAX_LEN][16];
+    uint8_t hi[TEDDY_MAX_LEN][16];
+    uint16_t bucket[TEDDY_BUCKETS][TEDDY_MAX_PATTERNS];
+    size_t bucket_n[TEDDY_BUCKETS];
+
+    const char *name;
+    multi_fn find;
+};
+
+// pats are kept, not copied; none may be empty
+void multi_compile(struct multi *mp, char **pats, size_t npats);
+void multi_free(struct multi *mp);
+
+const char *multi_find(const struct multi *mp, const char *hay, size_t n, size_t *len);
+
+#endif /* _MULTI_H_ */
@@ -0,0 +1,158 @@
+#include "mu.h"
+#include "out.h"
+
+#include <poll.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// two decimal digits per lookup
+static const char digits[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+void
+out_init_fd(struct out *o, int fd)
+{
+    o->fd = fd;
+    o->buf = mu_malloc(OUT_BUF_SIZE);
+    o->len = 0;
+    o->cap = OUT_BUF_SIZE;
+    o->keep_errors = false;
+    o->err = 0;
+    o->timeout = 0;
+}
+
+void
+out_init_mem(struct out *o)
+{
+    o->fd = -1;
+    o->buf = NULL;
+    o->len = 0;
+    o->cap = 0;
+    o->keep_errors = false;
+    o->err = 0;
+    o->timeout = 0;
+}
+
+void
+out_deinit(struct out *o)
+{
+    out_flush(o);
+    free(o->buf);
+    o->buf = NULL;
+}
+
+// A reader that went away (sgrep ... | head) normally ends the process with
+// SIGPIPE. Only where that is ignored does the write fail with EPIPE, which
+// is then a write error like any other, so the exit status tells it from a
+// run that printed everything.
+static void
+out_fd_write(struct out *o, const void *data, size_t n)
+{
+    struct pollfd pfd = {o->fd, POLLOUT, 0};
+    size_t done;
+    int err;
+
+    if (o->err != 0)
+    {
+        return;
+    }
+    while ((err = mu_write_n(o->fd, data, n, &done)) == -EAGAIN && o->timeout > 0)
+    {
+        data = (const char *)data + done;
+        n -= done;
+        if (poll(&pfd, 1, o->timeout) == 0)
+        {
+            err = -ETIMEDOUT;
+            break;
+        }
+    }
+    if (err < 0 && o->keep_errors)
+    {
+        o->err = err;
+        return;
+    }
+    if (err < 0)
+    {
+        mu_die_errno(-err, "write error");
+    }
+}
+
+void
+out_flush(struct out *o)
+{
+    if (o->fd == -1 || o->len == 0)
+    {
+        return;
+    }
+    out_fd_write(o, o->buf, o->len);
+    o->len = 0;
+}
+
+void
+out_write_slow(struct out *o, const void *data, size_t n)
+{
+    if (o->fd == -1)
+    {
+        size_t cap = o->cap ? 2 * o->cap : 4096;
+        while (cap < o->len + n)
+        {
+            cap *= 2;
+        }
+        o->buf = mu_realloc(o->buf, cap);
+        o->cap = cap;
+        memcpy(o->buf + o->len, data, n);
+        o->len += n;
+        return;
+    }
+
+    out_flush(o);
+    if (n >= o->cap)
+    {
+        // large enough to go straight out without a copy
+        out_fd_write(o, data, n);
+        return;
+    }
+    memcpy(o->buf, data, n);
+    o->len = n;
+}
+
+void
+out_long(struct out *o, long v)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+
+    while (u >= 100)
+    {
+        p -= 2;
+        memcpy(p, digits + 2 * (u % 100), 2);
+        u /= 100;
+    }
+    if (u >= 10)
+    {
+        p -= 2;
+        memcpy(p, digits + 2 * u, 2);
+    }
+    else
+    {
+        *--p = '0' + u;
+    }
+    if (v < 0)
+    {
+        *--p = '-';
+    }
+
+    out_write(o, p, tmp + sizeof(tmp) - p);
+}
@@ -0,0 +1,73 @@
+#ifndef _OUT_H_
+#define _OUT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+// size of the buffer in front of a file descriptor
+#define OUT_BUF_SIZE (256 * 1024)
+
+// An output buffer. With a file descriptor it is flushed whenever it fills
+// up; without one (fd -1) it grows and collects everything written, to be
+// handed on in one piece with out_write.
+struct out
+{
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+
+    // With keep_errors a failed write does not end the process: err holds
+    // its negative errno and whatever is written after it is dropped.
+    bool keep_errors;
+    int err;
+
+    // milliseconds a write to a non-blocking descriptor may wait for room
+    // before failing with ETIMEDOUT, 0 for not waiting at all
+    int timeout;
+};
+
+void out_init_fd(struct out *o, int fd);
+void out_init_mem(struct out *o);
+void out_deinit(struct out *o);
+
+// write out what is buffered; a no-op for in-memory buffers
+void out_flush(struct out *o);
+
+// the slow path of out_write, for data that does not fit the free space
+void out_write_slow(struct out *o, const void *data, size_t n);
+
+// append the decimal representation of v
+void out_long(struct out *o, long v);
+
+static inline void
+out_write(struct out *o, const void *data, size_t n)
+{
+    if (n <= o->cap - o->len)
+    {
+        memcpy(o->buf + o->len, data, n);
+        o->len += n;
+        return;
+    }
+    out_write_slow(o, data, n);
+}
+
+static inline void
+out_char(struct out *o, char c)
+{
+    if (o->len == o->cap)
+    {
+        out_write_slow(o, &c, 1);
+        return;
+    }
+    o->buf[o->len++] = c;
+}
+
+static inline void
+out_str(struct out *o, const char *s)
+{
+    out_write(o, s, strlen(s));
+}
+
+#endif /* _OUT_H_ */
@@ -0,0 +1,233 @@
+#include "mu.h"
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Work-stealing pool. Every worker owns a deque: tasks a worker submits go to
+// the tail of its own deque and it pops from there too, so a directory walk
+// keeps working depth first on what it just found while idle workers steal
+// the oldest tasks from the head of someone else's deque. Each deque has its
+// own lock, which is uncontended unless a steal is in progress.
+
+// index of the calling worker in its pool, -1 outside of the workers
+static __thread int self = -1;
+
+static void
+deque_init(struct pool_deque *dq)
+{
+    pthread_mutex_init(&dq->lock, NULL);
+    dq->cap = 64;
+    dq->tasks = mu_mallocarray(dq->cap, sizeof(*dq->tasks));
+    dq->head = 0;
+    dq->tail = 0;
+}
+
+static void
+deque_push(struct pool_deque *dq, struct pool_task task)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail - dq->head == dq->cap)
+    {
+        struct pool_task *tasks = mu_mallocarray(dq->cap * 2, sizeof(*tasks));
+        size_t i;
+
+        for (i = dq->head; i < dq->tail; i++)
+        {
+            tasks[i % (dq->cap * 2)] = dq->tasks[i % dq->cap];
+        }
+        free(dq->tasks);
+        dq->tasks = tasks;
+        dq->cap *= 2;
+    }
+    dq->tasks[dq->tail % dq->cap] = task;
+    dq->tail++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static bool
+deque_pop_tail(struct pool_deque *dq, struct pool_task *task)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head)
+    {
+        dq->tail--;
+        *task = dq->tasks[dq->tail % dq->cap];
+        ok = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return ok;
+}
+
+static bool
+deque_pop_head(struct pool_deque *dq, struct pool_task *task)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head)
+    {
+        *task = dq->tasks[dq->head % dq->cap];
+        dq->head++;
+        ok = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return ok;
+}
+
+// take a task from our own deque, or steal one starting with our neighbour
+static bool
+find_task(struct pool *pool, int id, struct pool_task *task)
+{
+    int i;
+
+    if (deque_pop_tail(&pool->workers[id].deque, task))
+    {
+        return true;
+    }
+    for (i = 1; i < pool->nworkers; i++)
+    {
+        if (deque_pop_head(&pool->workers[(id + i) % pool->nworkers].deque, task))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void *
+worker(void *arg)
+{
+    struct pool_worker *w = arg;
+    struct pool *pool = w->pool;
+    int id = w->id;
+    struct pool_task task;
+    unsigned long gen;
+
+    self = id;
+
+    while (1)
+    {
+        // note the generation first so a submission racing with our failed
+        // search below is not slept through
+        pthread_mutex_lock(&pool->idle_lock);
+        gen = pool->gen;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (find_task(pool, id, &task))
+        {
+            task.fn(pool, task.arg);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1)
+            {
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while (gen == pool->gen && atomic_load(&pool->pending) != 0)
+        {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (atomic_load(&pool->pending) == 0)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+void
+pool_init(struct pool *pool, int nworkers)
+{
+    int i;
+
+    pool->nworkers = nworkers;
+    pool->workers = mu_mallocarray(nworkers, sizeof(*pool->workers));
+    for (i = 0; i < nworkers; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        deque_init(&pool->workers[i].deque);
+    }
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->next, 0);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pool->gen = 0;
+}
+
+void
+pool_submit(struct pool *pool, pool_fn fn, void *arg)
+{
+    struct pool_task task = {fn, arg};
+    int id = self;
+
+    if (id < 0)
+    {
+        id = atomic_fetch_add(&pool->next, 1) % pool->nworkers;
+    }
+
+    atomic_fetch_add(&pool->pending, 1);
+    deque_push(&pool->workers[id].deque, task);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->gen++;
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+void
+pool_run(struct pool *pool)
+{
+    int i;
+
+    if (atomic_load(&pool->pending) == 0)
+    {
+        return;
+    }
+
+    // Workers steal from every deque, so when a thread cannot be had the
+    // calling thread takes the place of the worker that would have run on it
+    // and the ones after it go without.
+    for (i = 0; i < pool->nworkers; i++)
+    {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker, &pool->workers[i]) != 0)
+        {
+            worker(&pool->workers[i]);
+            self = -1;
+            break;
+        }
+    }
+    while (i-- > 0)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+}
+
+void
+pool_deinit(struct pool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nworkers; i++)
+    {
+        free(pool->workers[i].deque.tasks);
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+    }
+    free(pool->workers);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->idle_lock);
+}
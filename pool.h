@@ -0,0 +1,59 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+struct pool;
+
+typedef void (*pool_fn)(struct pool *pool, void *arg);
+
+struct pool_task
+{
+    pool_fn fn;
+    void *arg;
+};
+
+// one worker's task deque; the owner pushes and pops at the tail, thieves
+// take from the head
+struct pool_deque
+{
+    pthread_mutex_t lock;
+    struct pool_task *tasks;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+struct pool_worker
+{
+    struct pool *pool;
+    int id;
+    pthread_t thread;
+    struct pool_deque deque;
+};
+
+struct pool
+{
+    int nworkers;
+    struct pool_worker *workers;
+    atomic_size_t pending; // submitted tasks that have not finished yet
+    atomic_uint next;      // round robin target for submissions from outside
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    unsigned long gen; // bumped on every submission, under idle_lock
+};
+
+void pool_init(struct pool *pool, int nworkers);
+
+// queue fn(pool, arg); tasks may submit further tasks
+void pool_submit(struct pool *pool, pool_fn fn, void *arg);
+
+// run the workers until every submitted task, including the ones submitted
+// by tasks, has finished
+void pool_run(struct pool *pool);
+
+void pool_deinit(struct pool *pool);
+
+#endif /* _POOL_H_ */
@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+
+#include "mu.h"
+#include "reader.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+bool
+reader_compressed(const unsigned char *p, size_t n)
+{
+    static const unsigned char zstd[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+    return (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) || (n >= 4 && memcmp(p, zstd, 4) == 0);
+}
+
+// Read up to READER_BLOCK bytes into buf. A file is read in whole blocks;
+// a pipe hands over what it has, so that a slow writer's lines are not held
+// back until a block is full.
+static int
+raw_read(struct reader *rd, void *buf, size_t *n)
+{
+    ssize_t r;
+
+    if (rd->whole)
+    {
+        return mu_read_n(rd->fd, buf, READER_BLOCK, n);
+    }
+
+    while ((r = read(rd->fd, buf, READER_BLOCK)) == -1 && errno == EINTR)
+    {
+    }
+    *n = r > 0 ? (size_t)r : 0;
+    return r == -1 ? -errno : 0;
+}
+
+// -z: inflate up to READER_BLOCK bytes into buf. Concatenated gzip members
+// inflate as one stream, as with zcat. Like raw_read, a pipe is only
+// waited on while nothing was inflated yet. What was inflated before an
+// error is still handed out.
+static int
+gz_read(struct reader *rd, char *buf, size_t *n)
+{
+    z_stream *gz = rd->gz;
+    int err = 0;
+    int ret;
+
+    gz->next_out = (unsigned char *)buf;
+    gz->avail_out = READER_BLOCK;
+
+    while (gz->avail_out > 0)
+    {
+        if (gz->avail_in == 0)
+        {
+            size_t got;
+
+            if (rd->gz_eof || (!rd->whole && gz->avail_out < READER_BLOCK))
+            {
+                break;
+            }
+            err = raw_read(rd, rd->gz_in, &got);
+            if (err < 0)
+            {
+                break;
+            }
+            if (got == 0)
+            {
+                rd->gz_eof = true;
+                err = rd->gz_member ? -EBADMSG : 0;
+                break;
+            }
+            gz->next_in = rd->gz_in;
+            gz->avail_in = got;
+        }
+
+        rd->gz_member = true;
+        ret = inflate(gz, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+        {
+            rd->gz_member = false;
+            inflateReset(gz);
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            err = -EBADMSG;
+            break;
+        }
+    }
+
+    *n = READER_BLOCK - gz->avail_out;
+    return err;
+}
+
+// -z: the first bytes read tell whether the stream is compressed; gzip
+// input moves over to be inflated from then on
+static int
+sniff(struct reader *rd, char *buf, size_t *n)
+{
+    static const unsigned char zstd[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+    rd->sniffed = true;
+    if (!reader_compressed((unsigned char *)buf, *n))
+    {
+        return 0;
+    }
+    if (*n >= 4 && memcmp(buf, zstd, 4) == 0)
+    {
+        *n = 0;
+        return -ENOTSUP;
+    }
+
+    rd->gz = mu_zalloc(sizeof(*rd->gz));
+    if (inflateInit2(rd->gz, 15 + 16) != Z_OK)
+    {
+        free(rd->gz);
+        rd->gz = NULL;
+        *n = 0;
+        return -ENOMEM;
+    }
+    rd->gz_in = mu_malloc(READER_BLOCK);
+    memcpy(rd->gz_in, buf, *n);
+    rd->gz->next_in = rd->gz_in;
+    rd->gz->avail_in = *n;
+    return gz_read(rd, buf, n);
+}
+
+static int
+block_read(struct reader *rd, char *buf, size_t *n)
+{
+    int err;
+
+    if (rd->gz != NULL)
+    {
+        return gz_read(rd, buf, n);
+    }
+
+    err = raw_read(rd, buf, n);
+    if (err == 0 && rd->decompress && !rd->sniffed)
+    {
+        return sniff(rd, buf, n);
+    }
+    return err;
+}
+
+// Fill the two buffers in turn, each as soon as the caller gives it back.
+// Cancellation is only let through around the read, where the thread may
+// block on a pipe long after the caller lost interest (-q, -m).
+static void *
+read_ahead(void *arg)
+{
+    struct reader *rd = arg;
+    int i = 0;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (1)
+    {
+        struct reader_buf *b = &rd->bufs[i];
+        size_t n;
+        int err;
+
+        pthread_mutex_lock(&rd->lock);
+        while (b->full && !rd->stop)
+        {
+            pthread_cond_wait(&rd->cond, &rd->lock);
+        }
+        if (rd->stop)
+        {
+            pthread_mutex_unlock(&rd->lock);
+            break;
+        }
+        pthread_mutex_unlock(&rd->lock);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        err = block_read(rd, b->buf + b->head, &n);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&rd->lock);
+        b->len = n;
+        b->last = err < 0 || n == 0 || (rd->whole && n < READER_BLOCK);
+        b->full = true;
+        if (err < 0)
+        {
+            rd->err = err;
+        }
+        pthread_cond_broadcast(&rd->cond);
+        pthread_mutex_unlock(&rd->lock);
+
+        if (b->last)
+        {
+            break;
+        }
+        i ^= 1;
+    }
+
+    return NULL;
+}
+
+void
+reader_init(struct reader *rd, int fd, bool decompress)
+{
+    struct stat st;
+    int i, err;
+
+    memset(rd, 0, sizeof(*rd));
+    rd->fd = fd;
+    rd->whole = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    rd->cur = -1;
+    rd->carry = "";
+    rd->decompress = decompress;
+    for (i = 0; i < 2; i++)
+    {
+        rd->bufs[i].buf = mu_malloc(READER_HEAD + READER_BLOCK);
+        rd->bufs[i].head = READER_HEAD;
+    }
+    pthread_mutex_init(&rd->lock, NULL);
+    pthread_cond_init(&rd->cond, NULL);
+
+    err = pthread_create(&rd->thread, NULL, read_ahead, rd);
+    if (err != 0)
+    {
+        rd->err = -err;
+        rd->bufs[0].full = true;
+        rd->bufs[0].last = true;
+        return;
+    }
+    rd->started = true;
+}
+
+bool
+reader_next(struct reader *rd, const char **p, const char **end)
+{
+    while (!rd->done)
+    {
+        int next = rd->cur < 0 ? 0 : rd->cur ^ 1;
+        struct reader_buf *b = &rd->bufs[next];
+        const char *nl;
+        char *start;
+        size_t len;
+
+        pthread_mutex_lock(&rd->lock);
+        while (!b->full)
+        {
+            pthread_cond_wait(&rd->cond, &rd->lock);
+        }
+        pthread_mutex_unlock(&rd->lock);
+
+        // The carried line goes right in front of the block, growing the
+        // room for it when a line is longer than any seen so far.
+        if (rd->carry_len > b->head)
+        {
+            char *buf = mu_malloc(rd->carry_len + READER_BLOCK);
+            memcpy(buf + rd->carry_len, b->buf + b->head, b->len);
+            free(b->buf);
+            b->buf = buf;
+            b->head = rd->carry_len;
+        }
+        start = b->buf + b->head - rd->carry_len;
+        memcpy(start, rd->carry, rd->carry_len);
+        len = rd->carry_len + b->len;
+
+        // only now is nothing left in the old buffer
+        if (rd->cur >= 0)
+        {
+            pthread_mutex_lock(&rd->lock);
+            rd->bufs[rd->cur].full = false;
+            pthread_cond_broadcast(&rd->cond);
+            pthread_mutex_unlock(&rd->lock);
+        }
+        rd->cur = next;
+
+        if (b->last)
+        {
+            rd->done = true;
+            rd->carry_len = 0;
+            *p = start;
+            *end = start + len;
+            return len > 0;
+        }
+
+        nl = memrchr(start, '\n', len);
+        if (nl == NULL)
+        {
+            // no line ends in this block, carry all of it
+            rd->carry = start;
+            rd->carry_len = len;
+            continue;
+        }
+        *p = start;
+        *end = nl + 1;
+        rd->carry = nl + 1;
+        rd->carry_len = start + len - (nl + 1);
+        return true;
+    }
+
+    return false;
+}
+
+int
+reader_deinit(struct reader *rd)
+{
+    int i;
+
+    pthread_mutex_lock(&rd->lock);
+    rd->stop = true;
+    pthread_cond_broadcast(&rd->cond);
+    pthread_mutex_unlock(&rd->lock);
+
+    // a read still blocked on a pipe is of no use any more
+    if (rd->started)
+    {
+        pthread_cancel(rd->thread);
+        pthread_join(rd->thread, NULL);
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        free(rd->bufs[i].buf);
+    }
+    if (rd->gz != NULL)
+    {
+        inflateEnd(rd->gz);
+        free(rd->gz);
+        free(rd->gz_in);
+    }
+    pthread_cond_destroy(&rd->cond);
+    pthread_mutex_destroy(&rd->lock);
+    return rd->err;
+}
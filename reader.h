@@ -0,0 +1,68 @@
+#ifndef _READER_H_
+#define _READER_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// bytes read from a stream at a time
+#define READER_BLOCK (256 * 1024)
+
+// room kept in front of a block for the line carried over from the last one
+#define READER_HEAD (64 * 1024)
+
+struct reader_buf
+{
+    char *buf;
+    size_t head; // bytes in front of the block, for the carried line
+    size_t len;  // bytes read into the block
+    bool full;   // read and not yet given back by the caller
+    bool last;   // the read that filled it hit the end of the stream
+};
+
+// A double buffered reader: a thread reads the next block of a stream while
+// the caller searches the current one. The caller only ever sees whole
+// lines; the partial line at the end of a block is moved in front of the
+// next one.
+struct reader
+{
+    int fd;
+    bool whole;        // a regular file, read in whole blocks
+    bool decompress;   // -z: inflate the stream if it turns out to be gzip
+    bool sniffed;      // the first bytes were checked for a compressed format
+    struct z_stream_s *gz; // set once the stream was found to be gzip
+    unsigned char *gz_in;  // compressed bytes read but not inflated yet
+    bool gz_eof;       // no compressed bytes left to read
+    bool gz_member;    // inside a gzip member, which the end must not cut off
+    struct reader_buf bufs[2];
+    int cur;           // buffer held by the caller, -1 before the first
+    const char *carry; // partial line at the end of the current buffer
+    size_t carry_len;
+    bool done;         // the last block was handed out
+    bool stop;         // the caller is not going to ask for more
+    int err;           // read error, a negative errno
+    bool started;      // the read thread is running
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// is [p, p + n) the start of a gzip or zstd stream
+bool reader_compressed(const unsigned char *p, size_t n);
+
+// With decompress set, gzip input is inflated by the read thread. When the
+// thread cannot be started the stream reads as empty, and reader_deinit
+// returns the error.
+void reader_init(struct reader *rd, int fd, bool decompress);
+
+// Store the next run of whole lines in [*p, *end) and return true, or
+// return false at the end of the stream. Only the last run may end without
+// a newline. It stays valid until the next call.
+bool reader_next(struct reader *rd, const char **p, const char **end);
+
+// Stop the read thread; returns 0, or the negative errno of a failed read.
+// Corrupt or truncated gzip input is EBADMSG, zstd input ENOTSUP; scan_stream
+// reports both under the file name.
+int reader_deinit(struct reader *rd);
+
+#endif /* _READER_H_ */
@@ -0,0 +1,1391 @@
+#include "mu.h"
+#include "regex.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// largest counted repetition accepted in {m,n}
+#define REPEAT_MAX 1000
+
+// most NFA states an expression may compile to; nested counted repetitions
+// multiply, so REPEAT_MAX alone does not bound it
+#define NFA_STATES_MAX 100000
+
+// longest literal kept while extracting the prefilter
+#define LIT_MAX_LEN 64
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Parser. POSIX extended syntax: | * + ? {m,n} ( ) [ ] . ^ $ and backslash
+// escapes, plus \d \w \s and their negations. The result is a small syntax
+// tree used twice: once to pull out the literals the prefilter searches for
+// and once to build the NFA.
+
+enum ast_type
+{
+    AST_SET,
+    AST_CAT,
+    AST_ALT,
+    AST_REPEAT,
+    AST_BOL,
+    AST_EOL,
+    AST_EMPTY,
+};
+
+struct ast
+{
+    enum ast_type type;
+    uint64_t set[4];
+    struct ast **kids;
+    size_t nkids;
+    int min;
+    int max; // -1 for no upper bound
+};
+
+// the parse functions return NULL after a syntax error, which err describes
+struct parser
+{
+    const char *pat;
+    const char *s;
+    char err[128];
+};
+
+
+static void
+set_add(uint64_t *set, unsigned char c)
+{
+    set[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+static bool
+set_has(const uint64_t *set, unsigned char c)
+{
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+static void
+set_range(uint64_t *set, int lo, int hi)
+{
+    int c;
+
+    for (c = lo; c <= hi; c++)
+    {
+        set_add(set, c);
+    }
+}
+
+static void
+set_invert(uint64_t *set)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        set[i] = ~set[i];
+    }
+}
+
+static struct ast *
+ast_new(enum ast_type type)
+{
+    struct ast *node = mu_zalloc(sizeof(*node));
+
+    node->type = type;
+    return node;
+}
+
+static void
+ast_add(struct ast *node, struct ast *kid)
+{
+    node->kids = mu_reallocarray(node->kids, node->nkids + 1, sizeof(*node->kids));
+    node->kids[node->nkids++] = kid;
+}
+
+static void
+ast_free(struct ast *node)
+{
+    size_t i;
+
+    for (i = 0; i < node->nkids; i++)
+    {
+        ast_free(node->kids[i]);
+    }
+    free(node->kids);
+    free(node);
+}
+
+static struct ast *
+ast_char(unsigned char c)
+{
+    struct ast *node = ast_new(AST_SET);
+
+    set_add(node->set, c);
+    return node;
+}
+
+// \d \w \s and their upper case negations; false for any other letter
+static bool
+escape_class(char c, uint64_t *set)
+{
+    switch (c)
+    {
+    case 'd':
+    case 'D':
+        set_range(set, '0', '9');
+        break;
+    case 'w':
+    case 'W':
+        set_range(set, '0', '9');
+        set_range(set, 'a', 'z');
+        set_range(set, 'A', 'Z');
+        set_add(set, '_');
+        break;
+    case 's':
+    case 'S':
+        set_range(set, '\t', '\r');
+        set_add(set, ' ');
+        break;
+    default:
+        return false;
+    }
+
+    if (c >= 'A' && c <= 'Z')
+    {
+        set_invert(set);
+    }
+    return true;
+}
+
+static bool
+posix_class(const char *name, size_t len, uint64_t *set)
+{
+    int c;
+
+#define CLASS_IS(str) (len == sizeof(str) - 1 && memcmp(name, str, len) == 0)
+    for (c = 0; c < 256; c++)
+    {
+        bool in;
+
+        if (CLASS_IS("alpha"))
+            in = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        else if (CLASS_IS("digit"))
+            in = c >= '0' && c <= '9';
+        else if (CLASS_IS("alnum"))
+            in = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+        else if (CLASS_IS("upper"))
+            in = c >= 'A' && c <= 'Z';
+        else if (CLASS_IS("lower"))
+            in = c >= 'a' && c <= 'z';
+        else if (CLASS_IS("space"))
+            in = c == ' ' || (c >= '\t' && c <= '\r');
+        else if (CLASS_IS("blank"))
+            in = c == ' ' || c == '\t';
+        else if (CLASS_IS("punct"))
+            in = c > ' ' && c < 127 && !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'));
+        else if (CLASS_IS("xdigit"))
+            in = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+        else if (CLASS_IS("print"))
+            in = c >= ' ' && c < 127;
+        else if (CLASS_IS("graph"))
+            in = c > ' ' && c < 127;
+        else if (CLASS_IS("cntrl"))
+            in = c < ' ' || c == 127;
+        else
+            return false;
+
+        if (in)
+        {
+            set_add(set, c);
+        }
+    }
+#undef CLASS_IS
+
+    return true;
+}
+
+// record a syntax error; returns NULL for the parse function to pass on
+static struct ast *
+parse_fail(struct parser *ps, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(ps->err, sizeof(ps->err), fmt, ap);
+    va_end(ap);
+    return NULL;
+}
+
+static struct ast *
+parse_bracket(struct parser *ps)
+{
+    struct ast *node = ast_new(AST_SET);
+    bool negate = false;
+    bool first = true;
+
+    if (*ps->s == '^')
+    {
+        negate = true;
+        ps->s++;
+    }
+
+    while (first || *ps->s != ']')
+    {
+        unsigned char lo, hi;
+
+        if (*ps->s == '\0')
+        {
+            ast_free(node);
+            return parse_fail(ps, "unmatched [");
+        }
+        first = false;
+
+        if (ps->s[0] == '[' && ps->s[1] == ':')
+        {
+            const char *close = strstr(ps->s + 2, ":]");
+            if (close == NULL || !posix_class(ps->s + 2, close - ps->s - 2, node->set))
+            {
+                ast_free(node);
+                return parse_fail(ps, "invalid character class");
+            }
+            ps->s = close + 2;
+            continue;
+        }
+
+        lo = *ps->s++;
+        hi = lo;
+        if (ps->s[0] == '-' && ps->s[1] != ']' && ps->s[1] != '\0')
+        {
+            hi = ps->s[1];
+            ps->s += 2;
+            if (hi < lo)
+            {
+                ast_free(node);
+                return parse_fail(ps, "invalid range end");
+            }
+        }
+        set_range(node->set, lo, hi);
+    }
+    ps->s++;
+
+    if (negate)
+    {
+        set_invert(node->set);
+    }
+    return node;
+}
+
+static struct ast *parse_alt(struct parser *ps);
+
+static struct ast *
+parse_atom(struct parser *ps)
+{
+    struct ast *node;
+    unsigned char c = *ps->s++;
+
+    switch (c)
+    {
+    case '(':
+        node = parse_alt(ps);
+        if (node != NULL && *ps->s != ')')
+        {
+            ast_free(node);
+            return parse_fail(ps, "unmatched (");
+        }
+        ps->s++;
+        return node;
+    case '[':
+        return parse_bracket(ps);
+    case '.':
+        node = ast_new(AST_SET);
+        set_invert(node->set);
+        return node;
+    case '^':
+        return ast_new(AST_BOL);
+    case '$':
+        return ast_new(AST_EOL);
+    case '\\':
+        c = *ps->s++;
+        if (c == '\0')
+        {
+            return parse_fail(ps, "trailing backslash");
+        }
+        node = ast_new(AST_SET);
+        if (escape_class(c, node->set))
+        {
+            return node;
+        }
+        if (c == 't')
+        {
+            c = '\t';
+        }
+        else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '<' || c == '>')
+        {
+            // word boundaries and the like need look-behind the DFA lacks
+            ast_free(node);
+            return parse_fail(ps, "unsupported escape \\%c", c);
+        }
+        set_add(node->set, c);
+        return node;
+    default:
+        // includes a * + ? { that has nothing to repeat
+        return ast_char(c);
+    }
+}
+
+// {m}, {m,} or {m,n}; anything else leaves s alone and '{' is a literal.
+// An out of range count is a syntax error, also returning false.
+static bool
+parse_bounds(struct parser *ps, int *min, int *max)
+{
+    const char *s = ps->s + 1;
+    char *end;
+    long lo, hi;
+
+    if (*s < '0' || *s > '9')
+    {
+        return false;
+    }
+    lo = strtol(s, &end, 10);
+    hi = lo;
+    s = end;
+    if (*s == ',')
+    {
+        s++;
+        hi = -1;
+        if (*s >= '0' && *s <= '9')
+        {
+            hi = strtol(s, &end, 10);
+            s = end;
+        }
+    }
+    if (*s != '}')
+    {
+        return false;
+    }
+    if (lo > REPEAT_MAX || hi > REPEAT_MAX || (hi != -1 && hi < lo))
+    {
+        parse_fail(ps, "invalid repetition count");
+        return false;
+    }
+
+    ps->s = s + 1;
+    *min = lo;
+    *max = hi;
+    return true;
+}
+
+static struct ast *
+parse_repeat(struct parser *ps)
+{
+    struct ast *node = parse_atom(ps);
+
+    while (node != NULL)
+    {
+        int min, max;
+
+        if (*ps->s == '*')
+        {
+            min = 0;
+            max = -1;
+            ps->s++;
+        }
+        else if (*ps->s == '+')
+        {
+            min = 1;
+            max = -1;
+            ps->s++;
+        }
+        else if (*ps->s == '?')
+        {
+            min = 0;
+            max = 1;
+            ps->s++;
+        }
+        else if (*ps->s != '{' || !parse_bounds(ps, &min, &max))
+        {
+            if (ps->err[0] != '\0')
+            {
+                ast_free(node);
+                return NULL;
+            }
+            return node;
+        }
+
+        struct ast *rep = ast_new(AST_REPEAT);
+        rep->min = min;
+        rep->max = max;
+        ast_add(rep, node);
+        node = rep;
+    }
+    return NULL;
+}
+
+static struct ast *
+parse_cat(struct parser *ps)
+{
+    struct ast *node = ast_new(AST_CAT);
+
+    while (*ps->s != '\0' && *ps->s != '|' && *ps->s != ')')
+    {
+        struct ast *kid = parse_repeat(ps);
+        if (kid == NULL)
+        {
+            ast_free(node);
+            return NULL;
+        }
+        ast_add(node, kid);
+    }
+
+    if (node->nkids == 0)
+    {
+        node->type = AST_EMPTY;
+    }
+    return node;
+}
+
+static struct ast *
+parse_alt(struct parser *ps)
+{
+    struct ast *node = ast_new(AST_ALT);
+    struct ast *kid = parse_cat(ps);
+
+    while (kid != NULL)
+    {
+        ast_add(node, kid);
+        if (*ps->s != '|')
+        {
+            return node;
+        }
+        ps->s++;
+        kid = parse_cat(ps);
+    }
+    ast_free(node);
+    return NULL;
+}
+
+// returns NULL after printing what is wrong with pat
+static struct ast *
+parse(const char *pat)
+{
+    struct parser ps = {pat, pat, ""};
+    struct ast *node = parse_alt(&ps);
+
+    if (node != NULL && *ps.s != '\0')
+    {
+        ast_free(node);
+        node = parse_fail(&ps, "unmatched )");
+    }
+    if (node == NULL)
+    {
+        mu_stderr("sgrep: %s in '%s'", ps.err, pat);
+    }
+    return node;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Literal extraction. For every node we work out the finite set of strings
+// it matches exactly, when there is one, and a set of literals one of which
+// every match of the node contains. Concatenations glue exact sets together
+// into longer literals, alternations union them. The best set found for the
+// whole expression becomes the prefilter.
+
+struct lits
+{
+    bool inf; // unknown or too big to enumerate
+    int n;
+    size_t len[REGEX_MAX_LITERALS];
+    char s[REGEX_MAX_LITERALS][LIT_MAX_LEN];
+};
+
+static void
+lits_inf(struct lits *l)
+{
+    l->inf = true;
+    l->n = 0;
+}
+
+static void
+lits_empty(struct lits *l)
+{
+    l->inf = false;
+    l->n = 1;
+    l->len[0] = 0;
+}
+
+// higher is better, negative means useless as a prefilter
+static int
+lits_score(const struct lits *l)
+{
+    size_t min = LIT_MAX_LEN;
+    int i;
+
+    if (l->inf || l->n == 0)
+    {
+        return -1;
+    }
+    for (i = 0; i < l->n; i++)
+    {
+        min = MU_MIN(min, l->len[i]);
+    }
+    if (min == 0)
+    {
+        return -1;
+    }
+    return (int)min * 100 - l->n;
+}
+
+static void
+lits_better(struct lits *best, const struct lits *l)
+{
+    if (lits_score(l) > lits_score(best))
+    {
+        *best = *l;
+    }
+}
+
+static bool
+lits_cross(const struct lits *a, const struct lits *b, struct lits *out)
+{
+    int i, j;
+
+    if (a->n * b->n > REGEX_MAX_LITERALS)
+    {
+        return false;
+    }
+
+    out->inf = false;
+    out->n = 0;
+    for (i = 0; i < a->n; i++)
+    {
+        for (j = 0; j < b->n; j++)
+        {
+            if (a->len[i] + b->len[j] > LIT_MAX_LEN)
+            {
+                return false;
+            }
+            memcpy(out->s[out->n], a->s[i], a->len[i]);
+            memcpy(out->s[out->n] + a->len[i], b->s[j], b->len[j]);
+            out->len[out->n] = a->len[i] + b->len[j];
+            out->n++;
+        }
+    }
+    return true;
+}
+
+static bool
+lits_union(struct lits *a, const struct lits *b)
+{
+    int i;
+
+    if (a->inf || b->inf || a->n + b->n > REGEX_MAX_LITERALS)
+    {
+        return false;
+    }
+    for (i = 0; i < b->n; i++)
+    {
+        memcpy(a->s[a->n], b->s[i], b->len[i]);
+        a->len[a->n] = b->len[i];
+        a->n++;
+    }
+    return true;
+}
+
+static void
+extract(const struct ast *node, struct lits *exact, struct lits *req)
+{
+    struct lits ke, kr, cur, tmp;
+    bool whole = true;
+    size_t i;
+    int c;
+
+    lits_inf(req);
+    switch (node->type)
+    {
+    case AST_SET:
+        lits_empty(exact);
+        exact->n = 0;
+        for (c = 0; c < 256; c++)
+        {
+            if (!set_has(node->set, c))
+            {
+                continue;
+            }
+            if (exact->n == 4)
+            {
+                lits_inf(exact);
+                return;
+            }
+            exact->s[exact->n][0] = c;
+            exact->len[exact->n] = 1;
+            exact->n++;
+        }
+        *req = *exact;
+        return;
+
+    case AST_BOL:
+    case AST_EOL:
+    case AST_EMPTY:
+        lits_empty(exact);
+        return;
+
+    case AST_CAT:
+        lits_empty(&cur);
+        for (i = 0; i < node->nkids; i++)
+        {
+            extract(node->kids[i], &ke, &kr);
+            lits_better(req, &kr);
+            if (!ke.inf && lits_cross(&cur, &ke, &tmp))
+            {
+                cur = tmp;
+                continue;
+            }
+
+            // the run of exact strings ends here
+            lits_better(req, &cur);
+            whole = false;
+            if (ke.inf)
+            {
+                lits_empty(&cur);
+            }
+            else
+            {
+                cur = ke;
+            }
+        }
+        lits_better(req, &cur);
+        if (whole)
+        {
+            *exact = cur;
+        }
+        else
+        {
+            lits_inf(exact);
+        }
+        return;
+
+    case AST_ALT:
+        for (i = 0; i < node->nkids; i++)
+        {
+            extract(node->kids[i], &ke, &kr);
+            lits_better(&kr, &ke);
+
+            if (i == 0)
+            {
+                *exact = ke;
+                *req = kr;
+                continue;
+            }
+            if (!lits_union(exact, &ke))
+            {
+                lits_inf(exact);
+            }
+            if (lits_score(&kr) < 0 || !lits_union(req, &kr))
+            {
+                lits_inf(req);
+            }
+        }
+        if (lits_score(req) < 0)
+        {
+            lits_inf(req);
+        }
+        return;
+
+    case AST_REPEAT:
+        extract(node->kids[0], &ke, &kr);
+        lits_inf(exact);
+
+        // x{n} is x written n times, which x{n,} and x{n,m} start with
+        lits_empty(&cur);
+        if (ke.inf && node->min > 0)
+        {
+            lits_inf(&cur);
+        }
+        for (c = 0; c < node->min && !ke.inf; c++)
+        {
+            if (!lits_cross(&cur, &ke, &tmp))
+            {
+                lits_inf(&cur);
+                break;
+            }
+            cur = tmp;
+        }
+
+        if (node->min == node->max)
+        {
+            *exact = cur;
+        }
+        else if (node->min == 0 && node->max == 1 && !ke.inf)
+        {
+            lits_empty(&tmp);
+            *exact = ke;
+            if (!lits_union(exact, &tmp))
+            {
+                lits_inf(exact);
+            }
+        }
+        if (node->min >= 1)
+        {
+            *req = kr;
+            lits_better(req, &ke);
+            lits_better(req, &cur);
+        }
+        return;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Thompson construction, written backwards: compiling a node is given the
+// state to continue with and returns the state to enter it by.
+
+static int
+nfa_add(struct regex *re, enum nfa_type type, int out, int out1)
+{
+    if (re->nstates == re->cap)
+    {
+        re->cap = re->cap ? re->cap * 2 : 64;
+        re->states = mu_reallocarray(re->states, re->cap, sizeof(*re->states));
+    }
+    re->states[re->nstates].type = type;
+    re->states[re->nstates].out = out;
+    re->states[re->nstates].out1 = out1;
+    re->states[re->nstates].set = -1;
+
+    return re->nstates++;
+}
+
+static int
+nfa_set(struct regex *re, const uint64_t *set, int out)
+{
+    int s = nfa_add(re, NFA_SET, out, -1);
+
+    re->sets = mu_reallocarray(re->sets, re->nsets + 1, sizeof(*re->sets));
+    memcpy(re->sets[re->nsets], set, sizeof(re->sets[0]));
+    re->states[s].set = re->nsets++;
+
+    return s;
+}
+
+// Past NFA_STATES_MAX nothing more is compiled and regex_compile gives up,
+// which keeps both the states and the time spent bounded.
+static int
+compile(struct regex *re, const struct ast *node, int next)
+{
+    int s, i;
+
+    if (re->nstates >= NFA_STATES_MAX)
+    {
+        return next;
+    }
+
+    switch (node->type)
+    {
+    case AST_SET:
+        return nfa_set(re, node->set, next);
+    case AST_BOL:
+        return nfa_add(re, NFA_BOL, next, -1);
+    case AST_EOL:
+        return nfa_add(re, NFA_EOL, next, -1);
+    case AST_EMPTY:
+        return next;
+
+    case AST_CAT:
+        for (i = node->nkids - 1; i >= 0; i--)
+        {
+            next = compile(re, node->kids[i], next);
+        }
+        return next;
+
+    case AST_ALT:
+        s = compile(re, node->kids[node->nkids - 1], next);
+        for (i = node->nkids - 2; i >= 0; i--)
+        {
+            int kid = compile(re, node->kids[i], next);
+            s = nfa_add(re, NFA_SPLIT, kid, s);
+        }
+        return s;
+
+    case AST_REPEAT:
+        if (node->max == -1)
+        {
+            // x*: a split that either enters x, which loops back, or leaves.
+            // compile may move re->states, so its result is taken first.
+            int loop = nfa_add(re, NFA_SPLIT, -1, next);
+            int body = compile(re, node->kids[0], loop);
+            re->states[loop].out = body;
+            next = loop;
+        }
+        else
+        {
+            // x{0,k} as (x(x(x)?)?)?
+            for (i = 0; i < node->max - node->min && re->nstates < NFA_STATES_MAX; i++)
+            {
+                int kid = compile(re, node->kids[0], next);
+                next = nfa_add(re, NFA_SPLIT, kid, next);
+            }
+        }
+        for (i = 0; i < node->min && re->nstates < NFA_STATES_MAX; i++)
+        {
+            next = compile(re, node->kids[0], next);
+        }
+        return next;
+    }
+
+    return next;
+}
+
+// split the bytes into classes that every NFA set either wholly contains or
+// wholly misses; the newline always gets a class of its own, its transition
+// is never built and the search handles it out of line
+static void
+compute_classes(struct regex *re)
+{
+    uint16_t map[2][256];
+    size_t i;
+    int c, n;
+
+    memset(re->classes, 0, sizeof(re->classes));
+    re->nclasses = 1;
+    for (i = 0; i <= re->nsets; i++)
+    {
+        memset(map, 0xff, sizeof(map));
+        n = 0;
+        for (c = 0; c < 256; c++)
+        {
+            int in = i < re->nsets ? set_has(re->sets[i], c) : c == '\n';
+            uint16_t *slot = &map[in][re->classes[c]];
+            if (*slot == 0xffff)
+            {
+                *slot = n++;
+            }
+            re->classes[c] = *slot;
+        }
+        re->nclasses = n;
+    }
+
+    for (c = 255; c >= 0; c--)
+    {
+        re->rep[re->classes[c]] = c;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Lazy DFA. A DFA state is the sorted set of NFA states the search can be in
+// after the epsilon closure; NFA_EOL states stay in the set unresolved until
+// a line actually ends. States and transitions are created on first use and
+// kept in a per thread cache of at most DFA_MAX_STATES states.
+
+#define DFA_UNKNOWN UINT32_MAX
+#define DFA_MATCH 0x80000000u
+
+struct dstate
+{
+    size_t off; // first NFA state in the pool
+    uint32_t n;
+    uint32_t hash;
+    bool match;
+    int8_t eol; // -1 until known: does a line ending here match
+};
+
+struct dfa_cache
+{
+    const struct regex *re;
+    uint32_t *trans; // nclasses premultiplied entries per state, DFA_MATCH flags a match
+    struct dstate *states;
+    size_t nstates;
+    int *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    uint32_t *table; // open addressing, state index + 1
+    size_t table_cap;
+    uint32_t start;
+    int8_t empty; // -1 until known: does an empty line match
+    unsigned long flushes;
+
+    int *stack;
+    int *seeds;
+    int *set;
+    uint32_t *mark;
+    uint32_t gen;
+};
+
+static int
+cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+// epsilon closure of seeds into out, sorted; returns its size
+static size_t
+closure(struct dfa_cache *c, const int *seeds, size_t nseeds, bool bol, bool eol, int *out)
+{
+    const struct regex *re = c->re;
+    size_t sp = 0, n = 0, i;
+
+    if (++c->gen == 0)
+    {
+        memset(c->mark, 0, re->nstates * sizeof(*c->mark));
+        c->gen = 1;
+    }
+
+    for (i = 0; i < nseeds; i++)
+    {
+        c->stack[sp++] = seeds[i];
+    }
+    while (sp > 0)
+    {
+        int s = c->stack[--sp];
+        const struct nfa_state *st = &re->states[s];
+
+        if (c->mark[s] == c->gen)
+        {
+            continue;
+        }
+        c->mark[s] = c->gen;
+
+        switch (st->type)
+        {
+        case NFA_SET:
+        case NFA_MATCH:
+            out[n++] = s;
+            break;
+        case NFA_SPLIT:
+            c->stack[sp++] = st->out1;
+            c->stack[sp++] = st->out;
+            break;
+        case NFA_BOL:
+            if (bol)
+            {
+                c->stack[sp++] = st->out;
+            }
+            break;
+        case NFA_EOL:
+            if (eol)
+            {
+                c->stack[sp++] = st->out;
+            }
+            else
+            {
+                out[n++] = s;
+            }
+            break;
+        }
+    }
+
+    qsort(out, n, sizeof(*out), cmp_int);
+    return n;
+}
+
+static const char *
+line_end(const char *p, const char *end)
+{
+    const char *nl = memchr(p, '\n', end - p);
+
+    return nl != NULL ? nl + 1 : end;
+}
+
+static uint32_t
+hash_set(const int *set, size_t n)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        h = (h ^ (uint32_t)set[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void
+cache_flush(struct dfa_cache *c)
+{
+    c->nstates = 0;
+    c->pool_len = 0;
+    c->start = DFA_UNKNOWN;
+    c->flushes++;
+    memset(c->table, 0, c->table_cap * sizeof(*c->table));
+}
+
+static uint32_t
+add_state(struct dfa_cache *c, const int *set, size_t n)
+{
+    const struct regex *re = c->re;
+    uint32_t h = hash_set(set, n);
+    size_t slot, i;
+    struct dstate *ds;
+
+    for (slot = h & (c->table_cap - 1); c->table[slot] != 0; slot = (slot + 1) & (c->table_cap - 1))
+    {
+        ds = &c->states[c->table[slot] - 1];
+        if (ds->hash == h && ds->n == n && memcmp(c->pool + ds->off, set, n * sizeof(*set)) == 0)
+        {
+            return c->table[slot] - 1;
+        }
+    }
+
+    if (c->nstates == DFA_MAX_STATES)
+    {
+        cache_flush(c);
+        for (slot = h & (c->table_cap - 1); c->table[slot] != 0; slot = (slot + 1) & (c->table_cap - 1))
+            ;
+    }
+
+    if (c->pool_len + n > c->pool_cap)
+    {
+        c->pool_cap = (c->pool_len + n) * 2;
+        c->pool = mu_reallocarray(c->pool, c->pool_cap, sizeof(*c->pool));
+    }
+    memcpy(c->pool + c->pool_len, set, n * sizeof(*set));
+
+    ds = &c->states[c->nstates];
+    ds->off = c->pool_len;
+    ds->n = n;
+    ds->hash = h;
+    ds->eol = -1;
+    ds->match = false;
+    for (i = 0; i < n; i++)
+    {
+        if (re->states[set[i]].type == NFA_MATCH)
+        {
+            ds->match = true;
+        }
+    }
+    c->pool_len += n;
+
+    for (i = 0; i < (size_t)re->nclasses; i++)
+    {
+        c->trans[c->nstates * re->nclasses + i] = DFA_UNKNOWN;
+    }
+    c->table[slot] = c->nstates + 1;
+
+    return c->nstates++;
+}
+
+static uint32_t
+start_state(struct dfa_cache *c)
+{
+    if (c->start == DFA_UNKNOWN)
+    {
+        size_t n = closure(c, &c->re->start, 1, true, false, c->set);
+        c->start = add_state(c, c->set, n);
+    }
+    return c->start;
+}
+
+// fill in the transition from state s on byte class cls; like every entry
+// of trans it is the premultiplied row offset of the next state
+static uint32_t
+dfa_step(struct dfa_cache *c, uint32_t s, int cls)
+{
+    const struct regex *re = c->re;
+    const struct dstate *ds = &c->states[s];
+    unsigned long flushes = c->flushes;
+    unsigned char b = re->rep[cls];
+    size_t nseeds = 0, n, i;
+    uint32_t t;
+
+    for (i = 0; i < ds->n; i++)
+    {
+        const struct nfa_state *st = &re->states[c->pool[ds->off + i]];
+        if (st->type == NFA_SET && set_has(re->sets[st->set], b))
+        {
+            c->seeds[nseeds++] = st->out;
+        }
+    }
+
+    n = closure(c, c->seeds, nseeds, false, false, c->set);
+    t = add_state(c, c->set, n);
+    t = (c->states[t].match ? DFA_MATCH : 0) | t * re->nclasses;
+
+    // a flush renumbered everything, s no longer exists
+    if (c->flushes == flushes)
+    {
+        c->trans[s * re->nclasses + cls] = t;
+    }
+    return t;
+}
+
+// does a line that ends in state s match; bol says the line is empty, where
+// a ^ after a $ holds too, so the expression is tried afresh with both
+static bool
+eol_match(struct dfa_cache *c, uint32_t s, bool bol)
+{
+    struct dstate *ds = &c->states[s];
+    size_t nseeds = 0, n, i;
+
+    if (bol)
+    {
+        if (c->empty < 0)
+        {
+            c->empty = 0;
+            n = closure(c, &c->re->start, 1, true, true, c->set);
+            for (i = 0; i < n; i++)
+            {
+                if (c->re->states[c->set[i]].type == NFA_MATCH)
+                {
+                    c->empty = 1;
+                }
+            }
+        }
+        return c->empty;
+    }
+
+    if (ds->eol < 0)
+    {
+        for (i = 0; i < ds->n; i++)
+        {
+            const struct nfa_state *st = &c->re->states[c->pool[ds->off + i]];
+            if (st->type == NFA_EOL)
+            {
+                c->seeds[nseeds++] = st->out;
+            }
+        }
+
+        ds->eol = ds->match;
+        n = closure(c, c->seeds, nseeds, false, true, c->set);
+        for (i = 0; i < n; i++)
+        {
+            if (c->re->states[c->set[i]].type == NFA_MATCH)
+            {
+                ds->eol = 1;
+            }
+        }
+    }
+
+    return ds->eol;
+}
+
+static void
+cache_free(void *arg)
+{
+    struct dfa_cache *c = arg;
+
+    free(c->trans);
+    free(c->states);
+    free(c->pool);
+    free(c->table);
+    free(c->stack);
+    free(c->seeds);
+    free(c->set);
+    free(c->mark);
+    free(c);
+}
+
+static struct dfa_cache *
+cache_get(const struct regex *re)
+{
+    struct dfa_cache *c = pthread_getspecific(re->cache_key);
+
+    if (c != NULL)
+    {
+        return c;
+    }
+
+    c = mu_zalloc(sizeof(*c));
+    c->re = re;
+    c->trans = mu_mallocarray((size_t)DFA_MAX_STATES * re->nclasses, sizeof(*c->trans));
+    c->states = mu_mallocarray(DFA_MAX_STATES, sizeof(*c->states));
+    c->table_cap = 2 * DFA_MAX_STATES;
+    c->table = mu_calloc(c->table_cap, sizeof(*c->table));
+    c->stack = mu_mallocarray(2 * re->nstates + 1, sizeof(*c->stack));
+    c->seeds = mu_mallocarray(re->nstates, sizeof(*c->seeds));
+    c->set = mu_mallocarray(re->nstates, sizeof(*c->set));
+    c->mark = mu_calloc(re->nstates, sizeof(*c->mark));
+    c->start = DFA_UNKNOWN;
+    c->empty = -1;
+
+    if (pthread_setspecific(re->cache_key, c) != 0)
+    {
+        mu_die("pthread_setspecific failed");
+    }
+    return c;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// the literals and the NFA, for regex_compile giving up late
+static void
+nfa_free(struct regex *re)
+{
+    size_t i;
+
+    for (i = 0; i < re->nlits; i++)
+    {
+        free(re->lits[i]);
+    }
+    free(re->states);
+    free(re->sets);
+}
+
+bool
+regex_compile(struct regex *re, char **pats, size_t npats)
+{
+    struct ast *root = ast_new(AST_ALT);
+    struct lits exact, req;
+    size_t i;
+    int any, loop;
+
+    memset(re, 0, sizeof(*re));
+    for (i = 0; i < npats; i++)
+    {
+        struct ast *node = parse(pats[i]);
+        if (node == NULL)
+        {
+            ast_free(root);
+            return false;
+        }
+        ast_add(root, node);
+    }
+
+    // prefilter literals
+    extract(root, &exact, &req);
+    lits_better(&req, &exact);
+    if (lits_score(&req) > 0)
+    {
+        for (i = 0; i < (size_t)req.n; i++)
+        {
+            re->lits[i] = mu_malloc(req.len[i] + 1);
+            memcpy(re->lits[i], req.s[i], req.len[i]);
+            re->lits[i][req.len[i]] = '\0';
+        }
+        re->nlits = req.n;
+    }
+
+    // The expression is unanchored: the start state may also consume any
+    // byte and try again one position later.
+    int match = nfa_add(re, NFA_MATCH, -1, -1);
+    int body = compile(re, root, match);
+    ast_free(root);
+    if (re->nstates >= NFA_STATES_MAX)
+    {
+        mu_stderr("sgrep: regular expression too big");
+        nfa_free(re);
+        return false;
+    }
+    loop = nfa_add(re, NFA_SPLIT, body, -1);
+    uint64_t all[4] = {~0ull, ~0ull, ~0ull, ~0ull};
+    any = nfa_set(re, all, loop);
+    re->states[loop].out1 = any;
+    re->start = loop;
+
+    compute_classes(re);
+
+    if (pthread_key_create(&re->cache_key, cache_free) != 0)
+    {
+        mu_stderr("sgrep: pthread_key_create failed");
+        nfa_free(re);
+        return false;
+    }
+    return true;
+}
+
+void
+regex_free(struct regex *re)
+{
+    struct dfa_cache *c = pthread_getspecific(re->cache_key);
+
+    if (c != NULL)
+    {
+        cache_free(c);
+    }
+    pthread_key_delete(re->cache_key);
+    nfa_free(re);
+}
+
+bool
+regex_next_line(const struct regex *re, const char *p, const char *end, const char **ls, const char **le)
+{
+    struct dfa_cache *c = cache_get(re);
+    const uint32_t *trans = c->trans;
+    const uint8_t *classes = re->classes;
+    size_t ncl = re->nclasses;
+    const char *line = p;
+    const char *q = p;
+    uint32_t s;
+
+    if (p >= end)
+    {
+        return false;
+    }
+
+    // only the start state can match without a transition leading to it,
+    // and only for expressions that match the empty line
+    s = start_state(c);
+    if (c->states[s].match)
+    {
+        goto found;
+    }
+    s *= ncl;
+
+    for (; q < end; q++)
+    {
+        unsigned char b = *q;
+        uint32_t t = trans[s + classes[b]];
+
+        // newlines, unbuilt transitions and matches all have the top bit
+        // set and leave the fast path
+        if (t < DFA_MATCH)
+        {
+            s = t;
+            continue;
+        }
+
+        if (b == '\n')
+        {
+            if (eol_match(c, s / ncl, q == line))
+            {
+                *ls = line;
+                *le = q + 1;
+                return true;
+            }
+            line = q + 1;
+            s = start_state(c);
+            if (c->states[s].match)
+            {
+                q++;
+                goto found;
+            }
+            s *= ncl;
+            continue;
+        }
+
+        if (t == DFA_UNKNOWN)
+        {
+            t = dfa_step(c, s / ncl, classes[b]);
+        }
+        if (t & DFA_MATCH)
+        {
+            goto found;
+        }
+        s = t;
+    }
+
+    if (line < end && eol_match(c, s / ncl, false))
+    {
+        goto found;
+    }
+    return false;
+
+found:
+    *ls = line;
+    *le = line_end(q, end);
+    return true;
+}
+
+bool
+regex_match_line(const struct regex *re, const char *ls, const char *le)
+{
+    const char *a, *b;
+
+    return regex_next_line(re, ls, le, &a, &b);
+}
@@ -0,0 +1,68 @@
+#ifndef _REGEX_H_
+#define _REGEX_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// a lazily built DFA never holds more states than this; when it fills up the
+// cache is flushed and rebuilt from the state being searched
+#define DFA_MAX_STATES 4096
+
+// at most this many literals are extracted for the prefilter
+#define REGEX_MAX_LITERALS 16
+
+enum nfa_type
+{
+    NFA_SET,   // consume one byte from a set
+    NFA_SPLIT, // epsilon to out and out1
+    NFA_BOL,   // epsilon at the start of a line
+    NFA_EOL,   // epsilon at the end of a line
+    NFA_MATCH,
+};
+
+struct nfa_state
+{
+    enum nfa_type type;
+    int out;
+    int out1;
+    int set; // index into sets for NFA_SET
+};
+
+// an extended regular expression compiled to a Thompson NFA that the search
+// turns into DFA states on demand
+struct regex
+{
+    struct nfa_state *states;
+    size_t nstates;
+    size_t cap;
+    uint64_t (*sets)[4];
+    size_t nsets;
+    int start;
+
+    // bytes no set tells apart share a class, DFA rows have one entry each
+    uint8_t classes[256];
+    uint8_t rep[256]; // one byte of each class
+    int nclasses;
+
+    // literals one of which occurs in every match, or none
+    char *lits[REGEX_MAX_LITERALS];
+    size_t nlits;
+
+    // each thread searching with the regex builds its own DFA
+    pthread_key_t cache_key;
+};
+
+// pats are alternatives, a line matches if any of them matches; returns
+// false, having said why on stderr, when one is not a valid expression
+bool regex_compile(struct regex *re, char **pats, size_t npats);
+void regex_free(struct regex *re);
+
+// does the line [ls, le) match; le may include the newline
+bool regex_match_line(const struct regex *re, const char *ls, const char *le);
+
+// find the first matching line in [p, end), p being the start of a line
+bool regex_next_line(const struct regex *re, const char *p, const char *end, const char **ls, const char **le);
+
+#endif /* _REGEX_H_ */
@@ -0,0 +1,1082 @@
+#define _GNU_SOURCE
+
+#include "mu.h"
+#include "reader.h"
+#include "scan.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// -B on a stream keeps the last NUM lines as slices of its read buffer,
+// addressed by stream offset so that compacting the buffer moves no slice
+struct slice
+{
+    size_t off;
+    size_t len;
+    long line_num;
+};
+
+struct ring
+{
+    struct slice *slices;
+    size_t cap;
+    size_t head; // oldest slice
+    size_t n;
+};
+
+// print the "FILE:" and "NUM:" prefixes of an output line; sep is ':' for
+// matching lines and '-' for context lines
+static void
+prefix_print(const struct sink *sink, int linenumber, long line_num, char sep)
+{
+    if (sink->name != NULL)
+    {
+        out_str(sink->out, sink->name);
+        out_char(sink->out, sep);
+    }
+    if (linenumber)
+    {
+        out_long(sink->out, line_num);
+        out_char(sink->out, sep);
+    }
+}
+
+// Called before each group of context lines: a group that does not continue
+// the previous one, or the first of a file after another file's groups, is
+// set apart with "--".
+static void
+group_sep(const struct sink *sink, bool *started, bool adjacent)
+{
+    if (!*started)
+    {
+        *started = true;
+        if (sink->grouped == NULL || !atomic_exchange(sink->grouped, true))
+        {
+            return;
+        }
+    }
+    else if (adjacent)
+    {
+        return;
+    }
+    out_write(sink->out, "--\n", 3);
+}
+
+// write the lines in [p, end), terminating a last line that lacks its
+// newline so that the output of several files never runs together
+static void
+lines_write(const struct sink *sink, const char *p, const char *end)
+{
+    out_write(sink->out, p, end - p);
+    if (end > p && end[-1] != '\n')
+    {
+        out_char(sink->out, '\n');
+    }
+}
+
+static void
+ring_push(struct ring *ring, size_t off, size_t len, long line_num)
+{
+    struct slice *slice;
+
+    if (ring->n == ring->cap)
+    {
+        ring->head = (ring->head + 1) % ring->cap;
+        ring->n--;
+    }
+
+    slice = &ring->slices[(ring->head + ring->n) % ring->cap];
+    slice->off = off;
+    slice->len = len;
+    slice->line_num = line_num;
+    ring->n++;
+}
+
+// -A, -B and -C on a stream. The ring holds the NUM lines before the
+// current one; lines are numbered as they are read, which is how groups and
+// lines already printed are told apart.
+static int
+stream_context(const struct matcher *mt, const struct options *opts, const struct sink *sink, struct reader *rd)
+{
+    struct ring ring = {mu_mallocarray(opts->before_num + 1, sizeof(struct slice)), opts->before_num + 1, 0, 0};
+    size_t cap = 2 * READER_BLOCK;
+    char *buf = mu_malloc(cap);
+    size_t len = 0;
+    size_t base = 0; // stream offset of buf[0]
+    size_t pos = 0;  // first line not scanned yet
+    long line_num = 1;
+    long printed = 0; // number of the last line printed
+    int after_left = 0;
+    long selected = 0;
+    bool started = false;
+    bool eof = false;
+    size_t i;
+
+    while (1)
+    {
+        const char *nl, *block, *block_end;
+        size_t n;
+
+        while ((nl = memchr(buf + pos, '\n', len - pos)) != NULL || (eof && pos < len))
+        {
+            size_t end = nl != NULL ? (size_t)(nl - buf) + 1 : len;
+
+            // -m: once the last line is selected only its -A context is left
+            if (selected == opts->max_count && after_left == 0)
+            {
+                eof = true;
+                break;
+            }
+
+            ring_push(&ring, base + pos, end - pos, line_num);
+            if (selected < opts->max_count && matcher_line(mt, buf + pos, buf + end) != opts->invert)
+            {
+                selected++;
+                for (i = 0; i < ring.n; i++)
+                {
+                    const struct slice *slice = &ring.slices[(ring.head + i) % ring.cap];
+                    const char *line = buf + (slice->off - base);
+
+                    if (slice->line_num <= printed)
+                    {
+                        continue;
+                    }
+                    group_sep(sink, &started, printed == slice->line_num - 1);
+                    prefix_print(sink, opts->linenumber, slice->line_num, slice->line_num == line_num ? ':' : '-');
+                    lines_write(sink, line, line + slice->len);
+                    printed = slice->line_num;
+                }
+                after_left = opts->after_num;
+            }
+            else if (after_left > 0)
+            {
+                prefix_print(sink, opts->linenumber, line_num, '-');
+                lines_write(sink, buf + pos, buf + end);
+                printed = line_num;
+                after_left--;
+            }
+            pos = end;
+            line_num++;
+        }
+        if (eof)
+        {
+            break;
+        }
+        if (!reader_next(rd, &block, &block_end))
+        {
+            eof = true;
+            continue;
+        }
+
+        // Drop what no slice refers to any more, then make sure the block
+        // fits behind what is kept.
+        n = block_end - block;
+        if (cap - len < n)
+        {
+            size_t keep = ring.n > 0 ? ring.slices[ring.head].off - base : pos;
+            memmove(buf, buf + keep, len - keep);
+            len -= keep;
+            pos -= keep;
+            base += keep;
+            if (cap - len < n)
+            {
+                cap = 2 * (len + n);
+                buf = mu_realloc(buf, cap);
+            }
+        }
+        memcpy(buf + len, block, n);
+        len += n;
+    }
+
+    free(buf);
+    free(ring.slices);
+    return selected != 0 ? 0 : 1;
+}
+
+// return one past the newline ending the line that starts at p, or end if
+// the last line has no newline
+static const char *
+line_end(const char *p, const char *end)
+{
+    const char *nl = memchr(p, '\n', end - p);
+
+    return nl != NULL ? nl + 1 : end;
+}
+
+// return the start of the line containing p
+static const char *
+line_start(const char *data, const char *p)
+{
+    const char *nl = memrchr(data, '\n', p - data);
+
+    return nl != NULL ? nl + 1 : data;
+}
+
+// count the newlines in [p, end)
+static long
+count_lines(const char *p, const char *end)
+{
+    return search_count_lines(p, end - p);
+}
+
+// Search [p, end) as one buffer and return the first line holding a match,
+// storing its bounds in *ls and *le. Line boundaries are only looked up
+// around a hit, so lines without a candidate are never visited.
+// Without literals the DFA runs over everything; otherwise it only checks
+// the lines the prefilter finds one on.
+static bool
+next_regex_match(const struct matcher *mt, const char *data, const char *p, const char *end, const char **ls,
+                 const char **le)
+{
+    if (mt->pre == MATCHER_NONE)
+    {
+        return regex_next_line(&mt->re, p, end, ls, le);
+    }
+
+    while (p < end)
+    {
+        const char *hit = matcher_find(mt, p, end - p, NULL);
+        if (hit == NULL)
+        {
+            return false;
+        }
+
+        const char *s = line_start(data, hit);
+        const char *e = line_end(hit, end);
+        if (regex_match_line(&mt->re, s, e))
+        {
+            *ls = s;
+            *le = e;
+            return true;
+        }
+        p = e;
+    }
+
+    return false;
+}
+
+static bool
+next_match(const struct matcher *mt, const char *data, const char *p, const char *end, const char **ls, const char **le)
+{
+    if (mt->kind == MATCHER_REGEX)
+    {
+        return next_regex_match(mt, data, p, end, ls, le);
+    }
+
+    while (p < end)
+    {
+        size_t len;
+        const char *hit = matcher_find(mt, p, end - p, &len);
+        if (hit == NULL)
+        {
+            return false;
+        }
+
+        // a pattern holding a newline may straddle two lines, which a per-line
+        // search would never report
+        const char *eol = line_end(hit, end);
+        if (hit + len <= eol)
+        {
+            *ls = line_start(data, hit);
+            *le = eol;
+            return true;
+        }
+        p = hit + 1;
+    }
+
+    return false;
+}
+
+// lines in [p, end), a last one without its newline included
+static long
+lines_in(const char *p, const char *end)
+{
+    return count_lines(p, end) + (p < end && end[-1] != '\n');
+}
+
+// -c: count the matching lines in [p, end), p being the start of a line,
+// stopping at max. Lines are never looked at as such: after a hit the
+// search goes on from the next newline, and where the line starts is never
+// needed.
+static long
+count_matches(const struct matcher *mt, const char *data, const char *p, const char *end, long max)
+{
+    const char *ls, *le;
+    long n = 0;
+
+    // the empty pattern matches every line
+    if (mt->kind == MATCHER_LITERAL && mt->lit.len == 0)
+    {
+        return MU_MIN(lines_in(p, end), max);
+    }
+
+    // a regex has to see the whole line to verify a candidate
+    if (mt->kind == MATCHER_REGEX)
+    {
+        for (; n < max && next_match(mt, data, p, end, &ls, &le); p = le)
+        {
+            n++;
+        }
+        return n;
+    }
+
+    while (n < max && p < end)
+    {
+        size_t len;
+        const char *hit = matcher_find(mt, p, end - p, &len);
+        if (hit == NULL)
+        {
+            break;
+        }
+
+        const char *eol = line_end(hit, end);
+        if (hit + len <= eol)
+        {
+            n++;
+            p = eol;
+        }
+        else
+        {
+            p = hit + 1;
+        }
+    }
+
+    return n;
+}
+
+// the lines of [p, end) that -c reports, the matching ones or with -v the
+// rest, but no more than max
+static long
+count_selected(const struct matcher *mt, const struct options *opts, const char *data, const char *p, const char *end,
+               long max)
+{
+    if (opts->invert)
+    {
+        return MU_MIN(lines_in(p, end) - count_matches(mt, data, p, end, LONG_MAX), max);
+    }
+    return count_matches(mt, data, p, end, max);
+}
+
+// -q: is any line of [p, end) selected
+static bool
+any_selected(const struct matcher *mt, const struct options *opts, const char *data, const char *p, const char *end)
+{
+    const char *ls, *le;
+
+    if (!opts->invert)
+    {
+        return next_match(mt, data, p, end, &ls, &le);
+    }
+
+    for (; next_match(mt, data, p, end, &ls, &le); p = le)
+    {
+        if (ls > p)
+        {
+            return true;
+        }
+    }
+    return p < end;
+}
+
+// -A, -B and -C over a mapping: matches are fed in file order and every
+// line is printed at most once, context that overlaps or touches the
+// previous group's joining it
+struct context
+{
+    const struct options *opts;
+    const struct sink *sink;
+    const char *data;
+    const char *end;
+    const char *printed; // end of the last line printed, NULL before any
+    long printed_num;    // number of the line starting at printed
+    int after_left;      // -A lines still owed to the last match
+    bool started;
+};
+
+static void
+context_init(struct context *cx, const struct options *opts, const struct sink *sink, const char *data, const char *end)
+{
+    memset(cx, 0, sizeof(*cx));
+    cx->opts = opts;
+    cx->sink = sink;
+    cx->data = data;
+    cx->end = end;
+}
+
+// print the -A lines of the last match that come before limit
+static void
+context_after(struct context *cx, const char *limit)
+{
+    while (cx->after_left > 0 && cx->printed < limit)
+    {
+        const char *eol = line_end(cx->printed, limit);
+        prefix_print(cx->sink, cx->opts->linenumber, cx->printed_num, '-');
+        lines_write(cx->sink, cx->printed, eol);
+        cx->printed = eol;
+        cx->printed_num++;
+        cx->after_left--;
+    }
+}
+
+// print the matching line [ls, le) with the context before it not yet printed
+static void
+context_match(struct context *cx, const char *ls, const char *le, long line_num)
+{
+    const char *p = ls;
+    int n;
+
+    context_after(cx, ls);
+
+    for (n = 0; n < cx->opts->before_num && p > cx->data && (cx->printed == NULL || p > cx->printed); n++)
+    {
+        p = line_start(cx->data, p - 1);
+    }
+    group_sep(cx->sink, &cx->started, p == cx->printed);
+
+    for (line_num -= n; p < ls; line_num++)
+    {
+        const char *eol = line_end(p, ls);
+        prefix_print(cx->sink, cx->opts->linenumber, line_num, '-');
+        lines_write(cx->sink, p, eol);
+        p = eol;
+    }
+    prefix_print(cx->sink, cx->opts->linenumber, line_num, ':');
+    lines_write(cx->sink, ls, le);
+
+    cx->printed = le;
+    cx->printed_num = line_num + 1;
+    cx->after_left = cx->opts->after_num;
+}
+
+// print the matching line [ls, le) the way the standard and context modes do
+static void
+match_print(struct context *cx, const char *ls, const char *le, long line_num)
+{
+    if (cx->opts->context)
+    {
+        context_match(cx, ls, le, line_num);
+        return;
+    }
+
+    prefix_print(cx->sink, cx->opts->linenumber, line_num, ':');
+    lines_write(cx->sink, ls, le);
+}
+
+// -v: the lines in [p, end) did not match and are the ones printed, at
+// most max of them, the first being line line_num; returns how many were
+// printed. Unless every line needs a prefix of its own they go out as one
+// block.
+static long
+gap_print(struct context *cx, const char *p, const char *end, long line_num, long max)
+{
+    long n = 0;
+
+    if (!cx->opts->context && !cx->opts->linenumber && cx->sink->name == NULL)
+    {
+        n = lines_in(p, end);
+        for (; n > max; n--)
+        {
+            end = line_start(p, end - 1);
+        }
+        lines_write(cx->sink, p, end);
+        return n;
+    }
+
+    for (; p < end && n < max; n++)
+    {
+        const char *eol = line_end(p, end);
+        match_print(cx, p, eol, line_num);
+        p = eol;
+        line_num++;
+    }
+    return n;
+}
+
+// print the selected lines of [p, end), at most max of them, the first line
+// being line line_num; returns how many were printed
+static long
+lines_print(const struct matcher *mt, struct context *cx, const char *p, const char *end, long line_num, long max)
+{
+    const struct options *opts = cx->opts;
+    const char *ls, *le;
+    long selected = 0;
+
+    while (selected < max && next_match(mt, cx->data, p, end, &ls, &le))
+    {
+        long gap_num = line_num;
+
+        if (opts->linenumber)
+        {
+            line_num += count_lines(p, ls);
+        }
+        if (opts->invert)
+        {
+            selected += gap_print(cx, p, ls, gap_num, max - selected);
+            if (selected == max)
+            {
+                return selected;
+            }
+        }
+        else
+        {
+            match_print(cx, ls, le, line_num);
+            selected++;
+        }
+        line_num++;
+        p = le;
+    }
+    if (opts->invert && selected < max)
+    {
+        selected += gap_print(cx, p, end, line_num, max - selected);
+    }
+    return selected;
+}
+
+// in-place scanning of a mapped file on the calling thread
+static int
+scan_serial(const struct matcher *mt, const struct options *opts, const struct sink *sink, const char *data, size_t len)
+{
+    const char *end = data + len;
+    struct context cx;
+    long match_count = 0;
+
+    // quiet
+    if (opts->quiet)
+    {
+        return any_selected(mt, opts, data, data, end) ? 0 : 1;
+    }
+
+    // count
+    if (opts->count)
+    {
+        match_count = count_selected(mt, opts, data, data, end, opts->max_count);
+        prefix_print(sink, 0, 0, ':');
+        out_long(sink->out, match_count);
+        out_char(sink->out, '\n');
+        return match_count != 0 ? 0 : 1;
+    }
+
+    // standard output and context
+    context_init(&cx, opts, sink, data, end);
+    match_count = lines_print(mt, &cx, data, end, 1, opts->max_count);
+    context_after(&cx, end);
+    return match_count != 0 ? 0 : 1;
+}
+
+// Streams are read a block of whole lines at a time, each searched like a
+// small mapping while the reader fills the next one. Only -B needs lines
+// from an earlier block, which is what stream_context keeps them for.
+
+static int
+stream_count(const struct matcher *mt, const struct options *opts, const struct sink *sink, struct reader *rd)
+{
+    const char *p, *end;
+    long match_count = 0;
+
+    while (match_count < opts->max_count && reader_next(rd, &p, &end))
+    {
+        match_count += count_selected(mt, opts, p, p, end, opts->max_count - match_count);
+    }
+
+    prefix_print(sink, 0, 0, ':');
+    out_long(sink->out, match_count);
+    out_char(sink->out, '\n');
+    return match_count != 0 ? 0 : 1;
+}
+
+static int
+stream_lines(const struct matcher *mt, const struct options *opts, const struct sink *sink, struct reader *rd)
+{
+    const char *p, *end;
+    struct context cx;
+    long selected = 0;
+    long line_num = 1;
+
+    // quiet
+    if (opts->quiet)
+    {
+        while (reader_next(rd, &p, &end))
+        {
+            if (any_selected(mt, opts, p, p, end))
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    // count
+    if (opts->count)
+    {
+        return stream_count(mt, opts, sink, rd);
+    }
+
+    // context
+    if (opts->context)
+    {
+        return stream_context(mt, opts, sink, rd);
+    }
+
+    // standard output
+    while (selected < opts->max_count && reader_next(rd, &p, &end))
+    {
+        context_init(&cx, opts, sink, p, end);
+        selected += lines_print(mt, &cx, p, end, line_num, opts->max_count - selected);
+        if (opts->linenumber)
+        {
+            line_num += count_lines(p, end);
+        }
+    }
+    return selected != 0 ? 0 : 1;
+}
+
+// scanning of pipes and files that cannot be mapped
+int
+scan_stream(const struct matcher *mt, const struct options *opts, const struct sink *sink, int fd,
+            const char *name)
+{
+    struct reader rd;
+    int status;
+    int err;
+
+    reader_init(&rd, fd, opts->decompress);
+    status = stream_lines(mt, opts, sink, &rd);
+    err = reader_deinit(&rd);
+    if (err == -EBADMSG)
+    {
+        mu_stderr("sgrep: %s: corrupt or truncated gzip data", name);
+    }
+    else if (err == -ENOTSUP)
+    {
+        mu_stderr("sgrep: %s: zstd data is not supported", name);
+    }
+    else if (err < 0)
+    {
+        mu_stderr_errno(-err, "sgrep: %s", name);
+    }
+    return err < 0 ? 1 : status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// -j: the mapping is cut into newline aligned chunks that worker threads
+// search independently, recording their matching lines. The calling thread
+// prints the chunks strictly in file order as they complete, turning the
+// chunk relative line numbers into absolute ones with a running sum of each
+// chunk's newline count. Context is read straight from the mapping, so it
+// crosses chunk boundaries without any help from the workers.
+
+struct match
+{
+    const char *ls;
+    const char *le;
+    long line_num; // relative to the chunk start, 0 based
+};
+
+struct chunk
+{
+    const char *start;
+    const char *end;
+    struct match *matches;
+    size_t nmatches;
+    size_t cap;
+    long lines; // newlines in the chunk, only counted for -n
+    bool done;
+};
+
+struct par_scan
+{
+    const struct matcher *mt;
+    const struct options *opts;
+    const char *data;
+    struct chunk *chunks;
+    size_t nchunks;
+    atomic_size_t next;   // next chunk to hand out
+    size_t printed;       // chunks already printed by the caller
+    size_t window;        // how far workers may run ahead of printed
+    bool ordered;         // the caller prints chunks in order, -c only sums them
+    atomic_bool found;    // -q: a match was found, stop everyone
+    atomic_bool enough;   // -m: no later chunk is going to be printed
+    atomic_long counted;  // -c -m: lines counted by all workers so far
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void
+chunk_add(struct chunk *c, const char *ls, const char *le, long line_num)
+{
+    if (c->nmatches == c->cap)
+    {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->matches = mu_reallocarray(c->matches, c->cap, sizeof(*c->matches));
+    }
+    c->matches[c->nmatches].ls = ls;
+    c->matches[c->nmatches].le = le;
+    c->matches[c->nmatches].line_num = line_num;
+    c->nmatches++;
+}
+
+static void
+chunk_scan(struct par_scan *ps, struct chunk *c)
+{
+    const struct options *opts = ps->opts;
+    const char *p = c->start;
+    const char *ls, *le;
+    long line_num = 0;
+
+    // A match can never cross into the next chunk because chunks end on a
+    // newline, so chunk counts simply add up.
+    if (opts->count)
+    {
+        long n = count_selected(ps->mt, opts, ps->data, p, c->end, opts->max_count);
+
+        c->nmatches = n;
+        if (atomic_fetch_add(&ps->counted, n) + n >= opts->max_count)
+        {
+            atomic_store(&ps->enough, true);
+        }
+        return;
+    }
+    if (opts->quiet)
+    {
+        if (any_selected(ps->mt, opts, ps->data, p, c->end))
+        {
+            atomic_store(&ps->found, true);
+        }
+        return;
+    }
+
+    // Past max matches nothing after them is printed, so the chunk is
+    // done; with -v the matches are the lines left out and there is no
+    // such bound.
+    while ((opts->invert || (long)c->nmatches < opts->max_count) && next_match(ps->mt, ps->data, p, c->end, &ls, &le))
+    {
+        if (opts->linenumber)
+        {
+            line_num += count_lines(p, ls);
+        }
+        chunk_add(c, ls, le, line_num);
+        line_num++;
+        p = le;
+
+        if (atomic_load_explicit(&ps->enough, memory_order_relaxed))
+        {
+            return;
+        }
+    }
+
+    if (opts->linenumber)
+    {
+        c->lines = line_num + count_lines(p, c->end);
+    }
+}
+
+static void *
+worker(void *arg)
+{
+    struct par_scan *ps = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&ps->next, 1)) < ps->nchunks)
+    {
+        // bound the memory held by finished but unprinted chunks
+        pthread_mutex_lock(&ps->lock);
+        while (ps->ordered && i >= ps->printed + ps->window)
+        {
+            pthread_cond_wait(&ps->cond, &ps->lock);
+        }
+        pthread_mutex_unlock(&ps->lock);
+
+        if (!atomic_load(&ps->found) && !atomic_load(&ps->enough))
+        {
+            chunk_scan(ps, &ps->chunks[i]);
+        }
+
+        pthread_mutex_lock(&ps->lock);
+        ps->chunks[i].done = true;
+        pthread_cond_broadcast(&ps->cond);
+        pthread_mutex_unlock(&ps->lock);
+    }
+
+    return NULL;
+}
+
+// split [data, data + len) into chunks of about size bytes ending on a newline
+static size_t
+chunks_split(struct par_scan *ps, const char *data, size_t len, size_t size)
+{
+    const char *end = data + len;
+    const char *p = data;
+    size_t n = 0;
+
+    ps->chunks = mu_calloc(len / size + 1, sizeof(*ps->chunks));
+    while (p < end)
+    {
+        const char *q = (size_t)(end - p) > size ? line_end(p + size - 1, end) : end;
+        ps->chunks[n].start = p;
+        ps->chunks[n].end = q;
+        n++;
+        p = q;
+    }
+
+    return n;
+}
+
+// print up to max selected lines of a finished chunk whose first line is
+// line_base; returns the number of lines printed
+static long
+chunk_print(struct context *cx, const struct chunk *c, long line_base, long max)
+{
+    const char *p = c->start;
+    long line_num = line_base;
+    long selected = 0;
+    size_t m;
+
+    if (!cx->opts->invert)
+    {
+        for (m = 0; m < c->nmatches && (long)m < max; m++)
+        {
+            const struct match *match = &c->matches[m];
+            match_print(cx, match->ls, match->le, line_base + match->line_num);
+        }
+        return m;
+    }
+
+    for (m = 0; m < c->nmatches && selected < max; m++)
+    {
+        const struct match *match = &c->matches[m];
+
+        selected += gap_print(cx, p, match->ls, line_num, max - selected);
+        line_num = line_base + match->line_num + 1;
+        p = match->le;
+    }
+    if (selected < max)
+    {
+        selected += gap_print(cx, p, c->end, line_num, max - selected);
+    }
+    return selected;
+}
+
+static int
+scan_parallel(const struct matcher *mt, const struct options *opts, const struct sink *sink, const char *data, size_t len, size_t size)
+{
+    struct par_scan ps;
+    struct context cx;
+    pthread_t *threads;
+    long line_base = 1;
+    long match_count = 0;
+    int i, nthreads;
+    size_t c;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.mt = mt;
+    ps.opts = opts;
+    ps.data = data;
+    ps.nchunks = chunks_split(&ps, data, len, size);
+    ps.window = 4 * (size_t)opts->jobs;
+    ps.ordered = !opts->count;
+    atomic_init(&ps.next, 0);
+    atomic_init(&ps.found, false);
+    atomic_init(&ps.enough, false);
+    atomic_init(&ps.counted, 0);
+    pthread_mutex_init(&ps.lock, NULL);
+    pthread_cond_init(&ps.cond, NULL);
+
+    // the workers take chunks in turn, so fewer threads than asked for only
+    // make it slower; without any the file is scanned on this thread
+    threads = mu_mallocarray(opts->jobs, sizeof(*threads));
+    for (nthreads = 0; nthreads < opts->jobs; nthreads++)
+    {
+        if (pthread_create(&threads[nthreads], NULL, worker, &ps) != 0)
+        {
+            break;
+        }
+    }
+    if (nthreads == 0)
+    {
+        free(threads);
+        free(ps.chunks);
+        pthread_cond_destroy(&ps.cond);
+        pthread_mutex_destroy(&ps.lock);
+        return scan_serial(mt, opts, sink, data, len);
+    }
+    context_init(&cx, opts, sink, data, data + len);
+
+    for (c = 0; c < ps.nchunks && ps.ordered; c++)
+    {
+        struct chunk *chunk = &ps.chunks[c];
+
+        pthread_mutex_lock(&ps.lock);
+        while (!chunk->done)
+        {
+            pthread_cond_wait(&ps.cond, &ps.lock);
+        }
+        pthread_mutex_unlock(&ps.lock);
+
+        if (!opts->quiet)
+        {
+            match_count += chunk_print(&cx, chunk, line_base, opts->max_count - match_count);
+        }
+        line_base += chunk->lines;
+        free(chunk->matches);
+        chunk->matches = NULL;
+
+        // -m: the rest of the chunks only have to be let through
+        if (match_count == opts->max_count)
+        {
+            atomic_store(&ps.enough, true);
+        }
+        pthread_mutex_lock(&ps.lock);
+        ps.printed = atomic_load(&ps.enough) ? ps.nchunks : c + 1;
+        pthread_cond_broadcast(&ps.cond);
+        pthread_mutex_unlock(&ps.lock);
+        if (atomic_load(&ps.enough))
+        {
+            break;
+        }
+    }
+
+    for (i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    // -c: the workers counted their chunks in whatever order they got them
+    for (c = 0; c < ps.nchunks; c++)
+    {
+        if (!ps.ordered)
+        {
+            match_count += ps.chunks[c].nmatches;
+        }
+        free(ps.chunks[c].matches);
+    }
+    match_count = MU_MIN(match_count, opts->max_count);
+    free(ps.chunks);
+    pthread_cond_destroy(&ps.cond);
+    pthread_mutex_destroy(&ps.lock);
+
+    if (opts->quiet)
+    {
+        return atomic_load(&ps.found) ? 0 : 1;
+    }
+    if (opts->count)
+    {
+        prefix_print(sink, 0, 0, ':');
+        out_long(sink->out, match_count);
+        out_char(sink->out, '\n');
+        return match_count != 0 ? 0 : 1;
+    }
+    context_after(&cx, data + len);
+    return match_count != 0 ? 0 : 1;
+}
+
+// in-place scanning of a mapped file, lines are never copied
+int
+scan_mapped(const struct matcher *mt, const struct options *opts, const struct sink *sink, const char *data, size_t len)
+{
+    size_t size;
+
+    if (opts->jobs <= 1)
+    {
+        return scan_serial(mt, opts, sink, data, len);
+    }
+
+    // enough chunks for the workers to balance out, but none so small that
+    // handing them out costs more than searching them
+    size = len / (4 * (size_t)opts->jobs);
+    size = size > SCAN_CHUNK_MAX ? SCAN_CHUNK_MAX : size;
+    if (size < SCAN_CHUNK_MIN)
+    {
+        return scan_serial(mt, opts, sink, data, len);
+    }
+
+    return scan_parallel(mt, opts, sink, data, len, size);
+}
+
+int
+scan_ranges(const struct matcher *mt, const struct options *opts, const struct sink *sink, const char *data,
+            size_t len, const struct scan_range *ranges, size_t n)
+{
+    struct context cx;
+    long selected = 0;
+    size_t i;
+
+    context_init(&cx, opts, sink, data, data + len);
+    for (i = 0; i < n && selected < opts->max_count; i++)
+    {
+        const char *p = data + ranges[i].off;
+        const char *end = p + ranges[i].len;
+
+        if (opts->quiet)
+        {
+            if (any_selected(mt, opts, data, p, end))
+            {
+                return 0;
+            }
+        }
+        else if (opts->count)
+        {
+            selected += count_matches(mt, data, p, end, opts->max_count - selected);
+        }
+        else
+        {
+            selected += lines_print(mt, &cx, p, end, ranges[i].line, opts->max_count - selected);
+        }
+    }
+
+    if (opts->quiet)
+    {
+        return 1;
+    }
+    if (opts->count)
+    {
+        prefix_print(sink, 0, 0, ':');
+        out_long(sink->out, selected);
+        out_char(sink->out, '\n');
+    }
+    return selected != 0 ? 0 : 1;
+}
+
+size_t
+scan_collect(const struct matcher *mt, const char *data, size_t len, struct scan_range **ranges)
+{
+    const char *p = data;
+    const char *end = data + len;
+    const char *ls, *le;
+    struct scan_range *r = NULL;
+    size_t n = 0, cap = 0;
+    long line_num = 1;
+
+    while (next_match(mt, data, p, end, &ls, &le))
+    {
+        line_num += count_lines(p, ls);
+        if (n > 0 && r[n - 1].off + r[n - 1].len == (size_t)(ls - data))
+        {
+            r[n - 1].len += le - ls;
+        }
+        else
+        {
+            if (n == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                r = mu_reallocarray(r, cap, sizeof(*r));
+            }
+            r[n].off = ls - data;
+            r[n].len = le - ls;
+            r[n].line = line_num;
+            n++;
+        }
+        line_num++;
+        p = le;
+    }
+
+    *ranges = r;
+    return n;
+}
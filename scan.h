@@ -0,0 +1,67 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "matcher.h"
+#include "out.h"
+
+// command line settings the scan loops act on
+struct options
+{
+    int count;
+    int linenumber;
+    int quiet;
+    int context;    // any of -A, -B or -C was given
+    int before_num; // -B NUM
+    int after_num;  // -A NUM
+    int learnfreq;
+    int jobs;
+    int recursive;
+    int extended;
+    int invert;     // -v: select the lines that do not match
+    long max_count; // -m NUM: stop after NUM selected lines, LONG_MAX if not given
+    int uring;      // --io-uring
+    int decompress; // -z: search the contents of gzip input
+};
+
+// where a file's results go; when name is set it prefixes every output line
+struct sink
+{
+    struct out *out;
+    const char *name;
+    atomic_bool *grouped; // set once any file printed a context group, or NULL
+};
+
+// bounds on the size of the chunks a -j scan hands to each worker
+#define SCAN_CHUNK_MIN (1024 * 1024)
+#define SCAN_CHUNK_MAX (16 * 1024 * 1024)
+
+// Both return the exit status for the file: 0 when a line was selected, 1
+// otherwise. scan_stream also returns 1 when reading failed, which it
+// reports under name.
+int scan_stream(const struct matcher *mt, const struct options *opts, const struct sink *sink, int fd,
+                const char *name);
+int scan_mapped(const struct matcher *mt, const struct options *opts, const struct sink *sink, const char *data, size_t len);
+
+// a run of whole lines of a mapping, line being the number of its first
+struct scan_range
+{
+    size_t off;
+    size_t len;
+    long line;
+};
+
+// Like scan_mapped, but only the ranges of data, in ascending order, are
+// searched; the lines between them are known to hold no match. Not for -v
+// or the context modes.
+int scan_ranges(const struct matcher *mt, const struct options *opts, const struct sink *sink, const char *data,
+                size_t len, const struct scan_range *ranges, size_t n);
+
+// Find the lines of data holding a match, merging adjacent ones into one
+// range, and return their number; the ranges are stored in a new array in
+// *ranges, which is NULL when there are none.
+size_t scan_collect(const struct matcher *mt, const char *data, size_t len, struct scan_range **ranges);
+
+#endif /* _SCAN_H_ */
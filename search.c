@@ -0,0 +1,468 @@
+#include "search.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Rank of each byte value by how often it occurs in a mix of C source,
+// documentation prose and system logs, 0 being the rarest. Used to pick the
+// pattern bytes the kernels filter on, so that a pattern starting with 'e' or
+// a space does not raise a candidate at almost every position.
+static const uint8_t byte_rank[256] = {
+      0,   1,   2,   3,   4,   5,   6,   7,   8, 187, 237,   9, 123, 192,  10,  11,
+     12,  13,  14,  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,
+    255, 162, 183, 196, 161, 169, 173, 170, 223, 221, 206, 202, 214, 233, 240, 244,
+    236, 239, 238, 218, 226, 224, 220, 207, 201, 200, 231, 190, 199, 182, 198, 159,
+    168, 204, 188, 210, 195, 222, 194, 189, 181, 209, 175, 185, 212, 197, 211, 213,
+    205, 167, 208, 227, 216, 191, 180, 172, 193, 179, 164, 166, 174, 165, 157, 246,
+    160, 250, 234, 243, 241, 254, 229, 228, 230, 251, 178, 225, 248, 232, 249, 247,
+    245, 186, 242, 252, 253, 235, 217, 203, 215, 219, 184, 177, 163, 176, 171,  28,
+    149, 106, 141, 126, 143, 107, 154,  76, 125, 134,  29, 102,  97,  93,  77,  98,
+     94,  92, 155,  81, 147,  90,  30,  89, 139, 142,  31, 108, 131, 127,  82, 136,
+    122, 135, 118, 140, 148, 105,  32, 115,  95, 152,  78, 128, 104, 145, 113,  83,
+    114, 153, 121, 144, 112, 120, 150,  33, 133,  34, 124, 132, 138, 129, 109,  96,
+     35,  36, 151, 158, 130, 146,  37,  38,  84,  39,  40,  41,  79,  42,  43, 119,
+    137, 117,  44,  45,  46,  47,  48, 110,  49,  50,  51,  52,  53,  54,  55,  56,
+    100, 101, 156,  57,  99, 116,  80, 103,  58, 111,  59,  60,  61,  62,  63,  88,
+     64,  65,  66,  85,  86,  67,  87,  68,  69,  70,  71,  72,  73,  91,  74,  75,
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// All vector kernels use the same scheme: compare a block of candidate
+// positions shifted by rare1 against the pattern byte at rare1, the same block
+// shifted by rare2 against the byte at rare2, AND the two masks and only
+// memcmp the pattern at the positions that survive. The scalar kernel
+// finishes whatever tail is too short for a full block.
+
+static const char *
+find_scalar(const struct pattern *pat, const char *hay, size_t n)
+{
+    const char *p, *last;
+    size_t m = pat->len;
+    char b1 = pat->str[pat->rare1];
+    char b2 = pat->str[pat->rare2];
+
+    if (n < m)
+    {
+        return NULL;
+    }
+    p = hay + pat->rare1;
+    last = hay + n - m + pat->rare1;
+
+    while (p <= last)
+    {
+        p = memchr(p, b1, last - p + 1);
+        if (p == NULL)
+        {
+            return NULL;
+        }
+
+        const char *cand = p - pat->rare1;
+        if (cand[pat->rare2] == b2 && memcmp(cand, pat->str, m) == 0)
+        {
+            return cand;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+// Horspool: compare the window back to front and shift by the table entry
+// of the byte under the last pattern position
+static const char *
+find_horspool(const struct pattern *pat, const char *hay, size_t n)
+{
+    size_t m = pat->len;
+    const unsigned char last = pat->str[m - 1];
+    size_t i = 0;
+
+    while (i + m <= n)
+    {
+        unsigned char c = hay[i + m - 1];
+        if (c == last && memcmp(hay + i, pat->str, m - 1) == 0)
+        {
+            return hay + i;
+        }
+        i += pat->skip[c];
+    }
+
+    return NULL;
+}
+
+#if defined(__x86_64__)
+
+static const char *
+find_sse2(const struct pattern *pat, const char *hay, size_t n)
+{
+    const __m128i b1 = _mm_set1_epi8(pat->str[pat->rare1]);
+    const __m128i b2 = _mm_set1_epi8(pat->str[pat->rare2]);
+    size_t m = pat->len;
+    size_t i = 0;
+
+    for (; i + m + 16 <= n; i += 16)
+    {
+        __m128i c1 = _mm_loadu_si128((const __m128i *)(hay + i + pat->rare1));
+        __m128i c2 = _mm_loadu_si128((const __m128i *)(hay + i + pat->rare2));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(c1, b1), _mm_cmpeq_epi8(c2, b2)));
+
+        while (mask != 0)
+        {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit, pat->str, m) == 0)
+            {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(pat, hay + i, n - i);
+}
+
+__attribute__((target("avx2"))) static const char *
+find_avx2(const struct pattern *pat, const char *hay, size_t n)
+{
+    const __m256i b1 = _mm256_set1_epi8(pat->str[pat->rare1]);
+    const __m256i b2 = _mm256_set1_epi8(pat->str[pat->rare2]);
+    size_t m = pat->len;
+    size_t i = 0;
+
+    for (; i + m + 32 <= n; i += 32)
+    {
+        __m256i c1 = _mm256_loadu_si256((const __m256i *)(hay + i + pat->rare1));
+        __m256i c2 = _mm256_loadu_si256((const __m256i *)(hay + i + pat->rare2));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(c1, b1), _mm256_cmpeq_epi8(c2, b2)));
+
+        while (mask != 0)
+        {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit, pat->str, m) == 0)
+            {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(pat, hay + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static const char *
+find_avx512(const struct pattern *pat, const char *hay, size_t n)
+{
+    const __m512i b1 = _mm512_set1_epi8(pat->str[pat->rare1]);
+    const __m512i b2 = _mm512_set1_epi8(pat->str[pat->rare2]);
+    size_t m = pat->len;
+    size_t i = 0;
+
+    for (; i + m + 64 <= n; i += 64)
+    {
+        __m512i c1 = _mm512_loadu_si512((const void *)(hay + i + pat->rare1));
+        __m512i c2 = _mm512_loadu_si512((const void *)(hay + i + pat->rare2));
+        uint64_t mask = _mm512_cmpeq_epi8_mask(c1, b1) & _mm512_cmpeq_epi8_mask(c2, b2);
+
+        while (mask != 0)
+        {
+            unsigned bit = __builtin_ctzll(mask);
+            if (memcmp(hay + i + bit, pat->str, m) == 0)
+            {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(pat, hay + i, n - i);
+}
+
+#endif /* __x86_64__ */
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Newline counting for -n, only ever run over the stretch between one
+// reported match and the next. The SSE2 and AVX2 kernels subtract the
+// compare results from byte counters, which are folded into 64-bit sums with
+// a SAD before they can wrap; AVX-512 compares straight into a mask and
+// popcounts it.
+
+static size_t
+count_scalar(const char *p, size_t n)
+{
+    const char *end = p + n;
+    size_t lines = 0;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL)
+    {
+        lines++;
+        p++;
+    }
+
+    return lines;
+}
+
+#if defined(__x86_64__)
+
+static size_t
+count_sse2(const char *p, size_t n)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    __m128i sums = _mm_setzero_si128();
+    size_t i = 0;
+
+    while (i + 16 <= n)
+    {
+        __m128i acc = _mm_setzero_si128();
+        size_t stop = i + 255 * 16 < n ? i + 255 * 16 : n;
+
+        for (; i + 16 <= stop; i += 16)
+        {
+            __m128i c = _mm_loadu_si128((const __m128i *)(p + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(c, nl));
+        }
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(acc, _mm_setzero_si128()));
+    }
+
+    return _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums)) + count_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+count_avx2(const char *p, size_t n)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i sums = _mm256_setzero_si256();
+    size_t i = 0;
+
+    while (i + 32 <= n)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        size_t stop = i + 255 * 32 < n ? i + 255 * 32 : n;
+
+        for (; i + 32 <= stop; i += 32)
+        {
+            __m256i c = _mm256_loadu_si256((const __m256i *)(p + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(c, nl));
+        }
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(acc, _mm256_setzero_si256()));
+    }
+
+    return _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) + _mm256_extract_epi64(sums, 2) +
+           _mm256_extract_epi64(sums, 3) + count_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt"))) static size_t
+count_avx512(const char *p, size_t n)
+{
+    const __m512i nl = _mm512_set1_epi8('\n');
+    size_t lines = 0;
+    size_t i = 0;
+
+    for (; i + 64 <= n; i += 64)
+    {
+        __m512i c = _mm512_loadu_si512((const void *)(p + i));
+        lines += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(c, nl));
+    }
+    if (i < n)
+    {
+        // the tail through a masked load, which never touches bytes past n
+        __mmask64 tail = ~0ull >> (64 - (n - i));
+        __m512i c = _mm512_maskz_loadu_epi8(tail, p + i);
+        lines += _mm_popcnt_u64(_mm512_mask_cmpeq_epi8_mask(tail, c, nl));
+    }
+
+    return lines;
+}
+
+#endif /* __x86_64__ */
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+static const struct search_kernel kernel_scalar = {"scalar", find_scalar, count_scalar};
+static const struct search_kernel kernel_horspool = {"horspool", find_horspool, count_scalar};
+#if defined(__x86_64__)
+static const struct search_kernel kernel_sse2 = {"sse2", find_sse2, count_sse2};
+static const struct search_kernel kernel_avx2 = {"avx2", find_avx2, count_avx2};
+static const struct search_kernel kernel_avx512 = {"avx512", find_avx512, count_avx512};
+#endif
+
+static const struct search_kernel *selected = &kernel_scalar;
+
+void
+search_init(void)
+{
+#if defined(__x86_64__)
+    // __builtin_cpu_supports reads cpuid and also checks that the OS saves
+    // the wider register state, so a reported AVX-512 kernel is usable
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+    {
+        selected = &kernel_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        selected = &kernel_avx2;
+    }
+    else
+    {
+        selected = &kernel_sse2;
+    }
+#endif
+}
+
+const struct search_kernel *
+search_kernel(void)
+{
+    return selected;
+}
+
+const struct search_kernel *const *
+search_kernels(void)
+{
+    static const struct search_kernel *kernels[6];
+    size_t n = 0;
+
+    kernels[n++] = &kernel_scalar;
+    kernels[n++] = &kernel_horspool;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    kernels[n++] = &kernel_sse2;
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels[n++] = &kernel_avx2;
+    }
+    if (__builtin_cpu_supports("avx512bw"))
+    {
+        kernels[n++] = &kernel_avx512;
+    }
+#endif
+    kernels[n] = NULL;
+    return kernels;
+}
+
+void
+search_select(const struct search_kernel *k)
+{
+    selected = k;
+}
+
+size_t
+search_count_lines(const char *p, size_t n)
+{
+    return selected->count(p, n);
+}
+
+// Point rare1 at the pattern byte with the lowest score and rare2 at the
+// lowest scoring byte with a different value, or at another position when
+// the pattern repeats a single byte.
+static void
+choose_rare(struct pattern *pat, const uint64_t *score)
+{
+    const unsigned char *s = (const unsigned char *)pat->str;
+    size_t i;
+
+    pat->rare1 = 0;
+    for (i = 1; i < pat->len; i++)
+    {
+        if (score[s[i]] < score[s[pat->rare1]])
+        {
+            pat->rare1 = i;
+        }
+    }
+
+    pat->rare2 = pat->rare1 == 0 ? pat->len - 1 : 0;
+    for (i = 0; i < pat->len; i++)
+    {
+        if (s[i] == s[pat->rare1])
+        {
+            continue;
+        }
+        if (s[pat->rare2] == s[pat->rare1] || score[s[i]] < score[s[pat->rare2]])
+        {
+            pat->rare2 = i;
+        }
+    }
+}
+
+void
+pattern_compile(struct pattern *pat, const char *str)
+{
+    size_t i;
+
+    memset(pat, 0, sizeof(*pat));
+    pat->str = str;
+    pat->len = strlen(str);
+    if (pat->len < 2)
+    {
+        // empty and single byte patterns are handled by pattern_find
+        return;
+    }
+
+    uint64_t score[256];
+    for (i = 0; i < 256; i++)
+    {
+        score[i] = byte_rank[i];
+    }
+    choose_rare(pat, score);
+    pat->find = selected->find;
+
+    // the vector kernels stay ahead of Horspool at every length on x86, so
+    // the skip table only pays off in front of the scalar kernel
+    if (selected == &kernel_horspool || (selected == &kernel_scalar && pat->len >= PATTERN_HORSPOOL_MIN))
+    {
+        for (i = 0; i < 256; i++)
+        {
+            pat->skip[i] = pat->len;
+        }
+        for (i = 0; i < pat->len - 1; i++)
+        {
+            pat->skip[(unsigned char)str[i]] = pat->len - 1 - i;
+        }
+        pat->find = find_horspool;
+    }
+}
+
+void
+pattern_learn(struct pattern *pat, const char *sample, size_t n)
+{
+    uint64_t score[256] = {0};
+    size_t i;
+
+    if (pat->len < 2)
+    {
+        return;
+    }
+
+    // sample counts decide, the built-in ranks only break ties
+    for (i = 0; i < n; i++)
+    {
+        score[(unsigned char)sample[i]] += 256;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        score[i] += byte_rank[i];
+    }
+    choose_rare(pat, score);
+}
+
+const char *
+pattern_find(const struct pattern *pat, const char *hay, size_t n)
+{
+    if (pat->len == 0)
+    {
+        return hay;
+    }
+    if (pat->len == 1)
+    {
+        return memchr(hay, pat->str[0], n);
+    }
+    if (n < pat->len)
+    {
+        return NULL;
+    }
+
+    return pat->find(pat, hay, n);
+}
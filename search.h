@@ -0,0 +1,65 @@
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include <stddef.h>
+
+struct pattern;
+
+// a literal substring search kernel; returns the first occurrence of the
+// pattern in hay[0..n), or NULL. n is at least the pattern length.
+typedef const char *(*search_fn)(const struct pattern *pat, const char *hay, size_t n);
+
+// counts the newlines in p[0..n)
+typedef size_t (*count_fn)(const char *p, size_t n);
+
+struct search_kernel
+{
+    const char *name;
+    search_fn find;
+    count_fn count;
+};
+
+// without a vector kernel, patterns at least this long are searched with
+// Horspool's skip loop, which then outruns the memchr based scalar kernel
+#define PATTERN_HORSPOOL_MIN 16
+
+// a pattern compiled once and reused for every search of the run
+struct pattern
+{
+    const char *str;
+    size_t len;
+
+    // offsets of the two rarest pattern bytes, which the kernels filter
+    // candidates on
+    size_t rare1;
+    size_t rare2;
+
+    // Horspool shift for each byte value, only filled in when Horspool is used
+    size_t skip[256];
+
+    search_fn find;
+};
+
+// pick the fastest kernel the CPU supports, must be called before pattern_compile
+void search_init(void);
+
+const struct search_kernel *search_kernel(void);
+
+// For bench_match: every kernel this CPU can run, NULL terminated, and a way
+// to have pattern_compile use one of them. Horspool is listed on its own;
+// otherwise the scalar kernel hands patterns of PATTERN_HORSPOOL_MIN bytes
+// and more to it.
+const struct search_kernel *const *search_kernels(void);
+void search_select(const struct search_kernel *k);
+
+// number of newlines in p[0..n), with the selected kernel
+size_t search_count_lines(const char *p, size_t n);
+
+void pattern_compile(struct pattern *pat, const char *str);
+// re-pick the filter bytes by their frequency in a sample of the input
+#define PATTERN_SAMPLE_SIZE (64 * 1024)
+void pattern_learn(struct pattern *pat, const char *sample, size_t n);
+
+const char *pattern_find(const struct pattern *pat, const char *hay, size_t n);
+
+#endif /* _SEARCH_H_ */
@@ -0,0 +1,771 @@
+#define _GNU_SOURCE
+
+#include "mu.h"
+#include "serve.h"
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// A request is a native uint32_t length followed by that many bytes: the
+// query's arguments, each NUL terminated. The first message carries the
+// client's working directory and standard input, output and error as
+// SCM_RIGHTS; the server answers with the exit status in a single byte and
+// closes the connection.
+#define SERVE_NFDS 4
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// caches
+
+// empty a slot; npats is left at SIZE_MAX, which no pattern set matches,
+// and a slot emptied already may be emptied again
+static void
+matcher_slot_free(struct serve_matcher *sm)
+{
+    size_t j;
+
+    matcher_free(&sm->mt);
+    memset(&sm->mt, 0, sizeof(sm->mt));
+    for (j = 0; sm->pats != NULL && j < sm->npats; j++)
+    {
+        free(sm->pats[j]);
+    }
+    free(sm->pats);
+    sm->pats = NULL;
+    sm->npats = SIZE_MAX;
+}
+
+const struct matcher *
+serve_matcher(struct serve_cache *cache, char **pats, size_t npats, bool extended)
+{
+    struct serve_matcher *sm = NULL;
+    size_t i, j;
+
+    cache->tick++;
+    for (i = 0; i < cache->nmatchers; i++)
+    {
+        sm = &cache->matchers[i];
+        if (sm->npats != npats || sm->extended != extended)
+        {
+            continue;
+        }
+        for (j = 0; j < npats && strcmp(sm->pats[j], pats[j]) == 0; j++)
+        {
+        }
+        if (j == npats)
+        {
+            sm->used = cache->tick;
+            return &sm->mt;
+        }
+    }
+
+    if (cache->nmatchers < SERVE_MATCHERS)
+    {
+        sm = &cache->matchers[cache->nmatchers++];
+    }
+    else
+    {
+        sm = &cache->matchers[0];
+        for (i = 1; i < SERVE_MATCHERS; i++)
+        {
+            if (cache->matchers[i].used < sm->used)
+            {
+                sm = &cache->matchers[i];
+            }
+        }
+        matcher_slot_free(sm);
+    }
+
+    sm->pats = mu_mallocarray(npats + 1, sizeof(*sm->pats));
+    for (j = 0; j < npats; j++)
+    {
+        sm->pats[j] = mu_strdup(pats[j]);
+    }
+    sm->npats = npats;
+    sm->extended = extended;
+    sm->id = cache->tick;
+    sm->used = cache->tick;
+    if (!matcher_compile(&sm->mt, sm->pats, npats, extended))
+    {
+        matcher_slot_free(sm);
+        sm->used = 0;
+        return NULL;
+    }
+    return &sm->mt;
+}
+
+static size_t
+map_bucket(dev_t dev, ino_t ino)
+{
+    return ((uint64_t)dev * 0x9e3779b97f4a7c15u ^ (uint64_t)ino) % SERVE_MAP_BUCKETS;
+}
+
+static void
+result_unlink(struct serve_cache *cache, int idx)
+{
+    struct serve_result *r = &cache->results[idx];
+    int *link = &cache->maps[r->map].results;
+
+    while (*link != idx)
+    {
+        link = &cache->results[*link].next;
+    }
+    *link = r->next;
+    free(r->ranges);
+    cache->result_bytes -= r->nranges * sizeof(*r->ranges);
+    r->ranges = NULL;
+    r->map = -1;
+}
+
+// the least recently used result, dropped
+static int
+result_evict(struct serve_cache *cache)
+{
+    int victim = -1;
+    size_t i;
+
+    for (i = 0; i < cache->nresults; i++)
+    {
+        if (cache->results[i].map != -1 && (victim == -1 || cache->results[i].used < cache->results[victim].used))
+        {
+            victim = i;
+        }
+    }
+    if (victim != -1)
+    {
+        result_unlink(cache, victim);
+    }
+    return victim;
+}
+
+static void
+map_unlink(struct serve_cache *cache, int idx)
+{
+    struct serve_map *m = &cache->maps[idx];
+    int *link = &cache->buckets[map_bucket(m->dev, m->ino)];
+
+    while (*link != idx)
+    {
+        link = &cache->maps[*link].next;
+    }
+    *link = m->next;
+    while (m->results != -1)
+    {
+        result_unlink(cache, m->results);
+    }
+    munmap(m->data, m->len);
+    cache->map_bytes -= m->len;
+    m->data = NULL;
+}
+
+// the least recently used map, unmapped
+static int
+map_evict(struct serve_cache *cache)
+{
+    int victim = -1;
+    size_t i;
+
+    for (i = 0; i < cache->nmaps; i++)
+    {
+        if (cache->maps[i].data != NULL && (victim == -1 || cache->maps[i].used < cache->maps[victim].used))
+        {
+            victim = i;
+        }
+    }
+    if (victim != -1)
+    {
+        map_unlink(cache, victim);
+    }
+    return victim;
+}
+
+const struct serve_map *
+serve_map(struct serve_cache *cache, const char *path)
+{
+    struct serve_map *m;
+    struct stat st;
+    size_t bucket;
+    char *data;
+    int idx, fd;
+    size_t i;
+
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+    {
+        return NULL;
+    }
+
+    bucket = map_bucket(st.st_dev, st.st_ino);
+    for (idx = cache->buckets[bucket]; idx != -1; idx = m->next)
+    {
+        m = &cache->maps[idx];
+        if (m->dev != st.st_dev || m->ino != st.st_ino)
+        {
+            continue;
+        }
+        if (m->len == (size_t)st.st_size && m->mtime.tv_sec == st.st_mtim.tv_sec &&
+            m->mtime.tv_nsec == st.st_mtim.tv_nsec && m->ctime.tv_sec == st.st_ctim.tv_sec &&
+            m->ctime.tv_nsec == st.st_ctim.tv_nsec)
+        {
+            m->used = ++cache->tick;
+            return m;
+        }
+        map_unlink(cache, idx);
+        break;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0 || (size_t)st.st_size > SERVE_MAP_BYTES)
+    {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    while (cache->map_bytes + st.st_size > SERVE_MAP_BYTES)
+    {
+        map_evict(cache);
+    }
+
+    // a free slot, one left by a changed file or else the oldest map
+    for (i = 0; i < cache->nmaps && cache->maps[i].data != NULL; i++)
+    {
+    }
+    if (i == cache->nmaps && cache->nmaps < SERVE_MAPS)
+    {
+        cache->nmaps++;
+    }
+    idx = i < cache->nmaps ? (int)i : map_evict(cache);
+
+    m = &cache->maps[idx];
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    m->mtime = st.st_mtim;
+    m->ctime = st.st_ctim;
+    m->len = (size_t)st.st_size;
+    m->data = data;
+    m->used = ++cache->tick;
+    m->results = -1;
+    bucket = map_bucket(st.st_dev, st.st_ino);
+    m->next = cache->buckets[bucket];
+    cache->buckets[bucket] = idx;
+    cache->map_bytes += m->len;
+    return m;
+}
+
+bool
+serve_matches(struct serve_cache *cache, const struct serve_map *m, const struct matcher *mt, bool collect,
+              const struct scan_range **ranges, size_t *nranges)
+{
+    const struct serve_matcher *sm;
+    struct serve_result *r;
+    struct scan_range *found;
+    size_t i, n, bytes;
+    int map = m - cache->maps;
+    int idx;
+
+    // only a matcher that stays in the cache can be told apart from the
+    // next one by its id
+    for (i = 0; i < cache->nmatchers && mt != &cache->matchers[i].mt; i++)
+    {
+    }
+    if (i == cache->nmatchers)
+    {
+        return false;
+    }
+    sm = &cache->matchers[i];
+
+    for (idx = m->results; idx != -1; idx = r->next)
+    {
+        r = &cache->results[idx];
+        if (r->matcher == sm->id)
+        {
+            r->used = ++cache->tick;
+            *ranges = r->ranges;
+            *nranges = r->nranges;
+            return true;
+        }
+    }
+    if (!collect)
+    {
+        return false;
+    }
+
+    n = scan_collect(mt, m->data, m->len, &found);
+    bytes = n * sizeof(*found);
+    if (bytes > SERVE_RESULT_MAX)
+    {
+        free(found);
+        return false;
+    }
+
+    while (cache->result_bytes + bytes > SERVE_RESULT_BYTES)
+    {
+        result_evict(cache);
+    }
+    for (i = 0; i < cache->nresults && cache->results[i].map != -1; i++)
+    {
+    }
+    if (i == cache->nresults && cache->nresults < SERVE_RESULTS)
+    {
+        cache->nresults++;
+    }
+    idx = i < cache->nresults ? (int)i : result_evict(cache);
+
+    r = &cache->results[idx];
+    r->matcher = sm->id;
+    r->map = map;
+    r->ranges = found;
+    r->nranges = n;
+    r->used = ++cache->tick;
+    r->next = m->results;
+    cache->maps[map].results = idx;
+    cache->result_bytes += bytes;
+
+    *ranges = r->ranges;
+    *nranges = r->nranges;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// server
+
+// a connection whose request is still coming in
+struct conn
+{
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    int fds[SERVE_NFDS];
+    int nfds;
+};
+
+static void
+conn_close(int ep, struct conn *c)
+{
+    int i;
+
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    for (i = 0; i < c->nfds; i++)
+    {
+        close(c->fds[i]);
+    }
+    free(c->buf);
+    free(c);
+}
+
+// Read what the client sent so far. Returns 1 once the whole request is
+// in, 0 while more is to come and -1 when the connection is to be dropped.
+static int
+conn_read(struct conn *c)
+{
+    while (1)
+    {
+        char cbuf[CMSG_SPACE(sizeof(int) * SERVE_NFDS)];
+        struct msghdr msg;
+        struct iovec iov;
+        struct cmsghdr *cmsg;
+        uint32_t want;
+        ssize_t n;
+
+        if (c->cap - c->len < 4096)
+        {
+            c->cap = c->cap ? c->cap * 2 : 8192;
+            c->buf = mu_realloc(c->buf, c->cap);
+        }
+        iov.iov_base = c->buf + c->len;
+        iov.iov_len = c->cap - c->len;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1)
+        {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        if (n == 0)
+        {
+            return -1;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                int *fds = (int *)CMSG_DATA(cmsg);
+                int i;
+
+                for (i = 0; i < nfds; i++)
+                {
+                    if (c->nfds < SERVE_NFDS)
+                    {
+                        c->fds[c->nfds++] = fds[i];
+                    }
+                    else
+                    {
+                        close(fds[i]);
+                    }
+                }
+            }
+        }
+        c->len += n;
+
+        if (c->len >= sizeof(want))
+        {
+            memcpy(&want, c->buf, sizeof(want));
+            if (want > SERVE_REQUEST_MAX)
+            {
+                return -1;
+            }
+            if (c->len >= sizeof(want) + want)
+            {
+                return c->nfds == SERVE_NFDS ? 1 : -1;
+            }
+        }
+    }
+}
+
+// Our own descriptor for the client's standard output fd, on which a write
+// gives up after SERVE_SEND_TIMEOUT, so a client that stops reading cannot
+// hold up the others. A socket gets a send timeout. A pipe, FIFO or
+// terminal is opened again without blocking, which leaves the client's own
+// open file as it was, and out waits for it with poll. The caller closes
+// it.
+static int
+client_output(int fd)
+{
+    struct timeval tv = {SERVE_SEND_TIMEOUT, 0};
+    struct stat st;
+    char path[64];
+    int out;
+
+    if (fstat(fd, &st) == -1)
+    {
+        return dup(fd);
+    }
+    if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode))
+    {
+        mu_snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        out = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (out != -1)
+        {
+            return out;
+        }
+    }
+    else if (S_ISSOCK(st.st_mode))
+    {
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    return dup(fd);
+}
+
+// Run the request of c with the client's descriptors standing in for our
+// own, which home and saved hold meanwhile.
+static int
+conn_query(struct conn *c, struct serve_cache *cache, serve_fn fn, int home)
+{
+    char *p = c->buf + sizeof(uint32_t);
+    char *end;
+    char **argv;
+    uint32_t want;
+    int saved[3];
+    int argc = 0;
+    int status, out, i;
+
+    memcpy(&want, c->buf, sizeof(want));
+    end = p + want;
+    if (want == 0 || end[-1] != '\0')
+    {
+        return 1;
+    }
+    argv = mu_mallocarray(want / 2 + 2, sizeof(*argv));
+    for (; p < end; p += strlen(p) + 1)
+    {
+        argv[argc++] = p;
+    }
+    argv[argc] = NULL;
+    if (argc == 0 || fchdir(c->fds[0]) == -1)
+    {
+        free(argv);
+        return 1;
+    }
+
+    out = client_output(c->fds[2]);
+    for (i = 0; i < 3; i++)
+    {
+        saved[i] = dup(i);
+        dup2(i == STDOUT_FILENO && out != -1 ? out : c->fds[i + 1], i);
+    }
+    status = fn(cache, argc, argv);
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < 3; i++)
+    {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    if (out != -1)
+    {
+        close(out);
+    }
+    if (fchdir(home) == -1)
+    {
+        mu_die_errno(errno, "sgrep: fchdir");
+    }
+
+    free(argv);
+    return status;
+}
+
+static int
+serve_listen(const char *path)
+{
+    struct sockaddr_un sa;
+    struct stat st;
+    int sk;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path))
+    {
+        mu_stderr("sgrep: %s: socket path too long", path);
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
+
+    sk = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sk == -1)
+    {
+        mu_stderr_errno(errno, "sgrep: socket");
+        return -1;
+    }
+
+    // a socket left behind by a server that is gone is taken over, one that
+    // still answers is not
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && connect(sk, (struct sockaddr *)&sa, sizeof(sa)) == -1 &&
+        errno == ECONNREFUSED)
+    {
+        unlink(path);
+    }
+
+    // only the user running the server may send it queries
+    mode_t mask = umask(077);
+    int err = bind(sk, (struct sockaddr *)&sa, sizeof(sa)) == -1 ? errno : 0;
+    umask(mask);
+    if (err == 0 && listen(sk, SOMAXCONN) == -1)
+    {
+        err = errno;
+    }
+    if (err != 0)
+    {
+        mu_stderr_errno(err, "sgrep: %s", path);
+        close(sk);
+        return -1;
+    }
+
+    mu_set_nonblocking(sk);
+    return sk;
+}
+
+int
+serve_run(const char *path, serve_fn fn)
+{
+    struct serve_cache *cache;
+    struct epoll_event ev, evs[64];
+    int sk, ep, home, i, n;
+
+    sk = serve_listen(path);
+    if (sk == -1)
+    {
+        return 1;
+    }
+    home = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    if (home == -1 || ep == -1)
+    {
+        mu_die_errno(errno, "sgrep: --serve");
+    }
+
+    // a client that goes away leaves writes failing with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    cache = mu_zalloc(sizeof(*cache));
+    memset(cache->buckets, 0xff, sizeof(cache->buckets));
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, sk, &ev) == -1)
+    {
+        mu_die_errno(errno, "sgrep: epoll_ctl");
+    }
+
+    while (1)
+    {
+        n = epoll_wait(ep, evs, 64, -1);
+        if (n == -1 && errno != EINTR)
+        {
+            mu_die_errno(errno, "sgrep: epoll_wait");
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            struct conn *c = evs[i].data.ptr;
+            int fd;
+
+            if (c == NULL)
+            {
+                while ((fd = accept4(sk, NULL, NULL, SOCK_CLOEXEC)) != -1)
+                {
+                    mu_set_nonblocking(fd);
+                    c = mu_zalloc(sizeof(*c));
+                    c->fd = fd;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1)
+                    {
+                        mu_die_errno(errno, "sgrep: epoll_ctl");
+                    }
+                }
+                continue;
+            }
+
+            switch (conn_read(c))
+            {
+            case 1:
+            {
+                unsigned char status = conn_query(c, cache, fn, home);
+                if (write(c->fd, &status, 1) == -1)
+                {
+                    // the client is gone, nothing to tell it
+                }
+                conn_close(ep, c);
+                break;
+            }
+            case -1:
+                conn_close(ep, c);
+                break;
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// client
+
+int
+serve_client(const char *path, int argc, char *argv[])
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * SERVE_NFDS)];
+    int fds[SERVE_NFDS] = {-1, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    struct sockaddr_un sa;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    size_t len = sizeof(uint32_t);
+    unsigned char status;
+    uint32_t body;
+    char *buf;
+    ssize_t n;
+    int sk, i;
+
+    for (i = 0; i < argc; i++)
+    {
+        len += strlen(argv[i]) + 1;
+    }
+    if (len - sizeof(uint32_t) > SERVE_REQUEST_MAX)
+    {
+        mu_die("sgrep: arguments too long to send");
+    }
+    buf = mu_malloc(len);
+    body = len - sizeof(uint32_t);
+    memcpy(buf, &body, sizeof(body));
+    for (len = sizeof(uint32_t), i = 0; i < argc; i++)
+    {
+        size_t arg_len = strlen(argv[i]) + 1;
+        memcpy(buf + len, argv[i], arg_len);
+        len += arg_len;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path))
+    {
+        mu_die("sgrep: %s: socket path too long", path);
+    }
+    strcpy(sa.sun_path, path);
+    sk = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sk == -1 || connect(sk, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+    {
+        mu_die_errno(errno, "sgrep: %s", path);
+    }
+    fds[0] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fds[0] == -1)
+    {
+        mu_die_errno(errno, "sgrep: .");
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // a server that answers before the request is all in must not take us
+    // down with SIGPIPE
+    while ((n = sendmsg(sk, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+    {
+    }
+    if (n == -1 || ((size_t)n < len && mu_write_n(sk, buf + n, len - n, NULL) < 0))
+    {
+        mu_die_errno(errno, "sgrep: %s", path);
+    }
+    free(buf);
+    close(fds[0]);
+
+    // the results go straight to our standard output, only the status
+    // comes back this way
+    while ((n = read(sk, &status, 1)) == -1 && errno == EINTR)
+    {
+    }
+    close(sk);
+    if (n != 1)
+    {
+        mu_die("sgrep: %s: the server did not answer", path);
+    }
+    return status;
+}
@@ -0,0 +1,114 @@
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "matcher.h"
+#include "scan.h"
+
+// compiled pattern sets kept between queries
+#define SERVE_MATCHERS 64
+
+// files kept mapped between queries, and the address space they may take
+#define SERVE_MAPS 1024
+#define SERVE_MAP_BYTES ((size_t)8 << 30)
+
+// match results kept between queries, and the memory they may take; a
+// result larger than SERVE_RESULT_MAX is not kept
+#define SERVE_RESULTS 16384
+#define SERVE_RESULT_BYTES ((size_t)256 << 20)
+#define SERVE_RESULT_MAX (SERVE_RESULT_BYTES / 8)
+
+// largest request a client may send
+#define SERVE_REQUEST_MAX (1024 * 1024)
+
+// seconds the output of a query may wait for the client to read it before
+// the query fails
+#define SERVE_SEND_TIMEOUT 10
+
+struct serve_matcher
+{
+    char **pats; // owned copies, which the matcher points into
+    size_t npats;
+    bool extended;
+    struct matcher mt;
+    unsigned long id;   // tick it was compiled at, which results refer to
+    unsigned long used; // tick of the last query that used it
+};
+
+struct serve_map
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime; // which no rewrite can set back, unlike the mtime
+    size_t len;
+    char *data;
+    unsigned long used;
+    int next;    // next map in the same bucket, -1 at the end
+    int results; // first result for this map, -1 if none
+};
+
+// the lines of a mapped file holding a match of one cached matcher
+struct serve_result
+{
+    unsigned long matcher; // id of the matcher
+    int map;               // index of the map, -1 for a free slot
+    struct scan_range *ranges;
+    size_t nranges;
+    unsigned long used;
+    int next; // next result for the same map, -1 at the end
+};
+
+#define SERVE_MAP_BUCKETS 4096
+
+// What --serve keeps warm from one query to the next. A cached map stays
+// valid while the file's device, inode, mtime, ctime and size are unchanged,
+// and so do the results found in it, which go with it; the least recently
+// used entry goes when a table is full.
+struct serve_cache
+{
+    struct serve_matcher matchers[SERVE_MATCHERS];
+    size_t nmatchers;
+    struct serve_map maps[SERVE_MAPS];
+    size_t nmaps;
+    size_t map_bytes;
+    int buckets[SERVE_MAP_BUCKETS]; // first map of each bucket, -1 if none
+    struct serve_result results[SERVE_RESULTS];
+    size_t nresults;
+    size_t result_bytes;
+    unsigned long tick;
+};
+
+// Run one query of a client on behalf of serve_run, with the client's
+// standard input, output and error as descriptors 0, 1 and 2 and its
+// working directory as the current one. Returns its exit status.
+typedef int (*serve_fn)(struct serve_cache *cache, int argc, char *argv[]);
+
+// --serve: accept queries on the Unix socket at path, one after another;
+// returns only when the socket cannot be set up
+int serve_run(const char *path, serve_fn fn);
+
+// --client: hand argv to the server at path and return its exit status
+int serve_client(const char *path, int argc, char *argv[]);
+
+// the matcher compiled from pats, compiling it on first use; NULL when a
+// regular expression does not parse
+const struct matcher *serve_matcher(struct serve_cache *cache, char **pats, size_t npats, bool extended);
+
+// the mapping of the regular file at path, mapped on first use or when the
+// file changed; NULL for an empty file or anything that cannot be mapped
+const struct serve_map *serve_map(struct serve_cache *cache, const char *path);
+
+// Store in *ranges and *nranges the lines of the file mapped by m that hold
+// a match of mt, in runs of adjacent ones as scan_ranges takes them. With
+// collect set they are found by a scan of the whole file when not cached
+// yet. Returns false when they are not at hand or mt is not a cached matcher.
+bool serve_matches(struct serve_cache *cache, const struct serve_map *m, const struct matcher *mt, bool collect,
+                   const struct scan_range **ranges, size_t *nranges);
+
+#endif /* _SERVE_H_ */
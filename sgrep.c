@@ -1,20 +1,42 @@
-#include "list.h"
+#define _GNU_SOURCE
+
+#include "index.h"
+#include "matcher.h"
 #include "mu.h"
+#include "out.h"
+#include "pool.h"
+#include "reader.h"
+#include "scan.h"
+#include "search.h"
+#include "serve.h"
+#include "uring.h"
 
-#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 // macro for USAGE output to be used with -h
 #define USAGE                                                                                                    \
-    "Usage: sgrep [-c] [-h] [-n] [-q] [-B NUM] STR FILE\n"                                                       \
+    "Usage: sgrep [-c] [-h] [-n] [-q] [-r] [-v] [-z] [-A NUM] [-B NUM] [-C NUM] [-E] [-e STR]... [-f FILE]\n"    \
+    "             [-j NUM] [-m NUM] STR [FILE...]\n"                                                             \
+    "       sgrep index build DIR [INDEX]\n"                                                                     \
+    "       sgrep index refresh [INDEX]\n"                                                                       \
+    "       sgrep --serve SOCKET\n"                                                                              \
+    "       sgrep --client SOCKET [OPTION]... STR [FILE...]\n"                                                   \
     "\n"                                                                                                         \
-    "Print lines in FILE that match STR.\n"                                                                      \
+    "Print lines in each FILE that match STR. With no FILE, or when FILE is -, read standard input.\n"           \
     "\n"                                                                                                         \
     "optional arguments\n"                                                                                       \
     "   -c, --count\n"                                                                                           \
@@ -29,256 +51,774 @@
     "   -q, --quiet\n"                                                                                           \
     "       Exit immediately if any match was found. If a match is not found, exit with a non-zero status.\n"    \
     "\n"                                                                                                         \
+    "   -r, --recursive\n"                                                                                       \
+    "       Search every regular file below each directory FILE, or below the current directory.\n"              \
+    "\n"                                                                                                         \
+    "   -v, --invert-match\n"                                                                                    \
+    "       Select the lines that do not match STR.\n"                                                           \
+    "\n"                                                                                                         \
+    "   -z, --decompress\n"                                                                                      \
+    "       Search the decompressed contents of gzip FILEs and input, recognised by their magic bytes.\n"        \
+    "\n"                                                                                                         \
+    "   -A NUM, --after-context NUM\n"                                                                           \
+    "       Print NUM lines of trailing context after matching lines.\n"                                         \
+    "\n"                                                                                                         \
     "   -B NUM, --before-context NUM\n"                                                                          \
     "       Print NUM lines of leading context before matching lines.\n"                                         \
+    "\n"                                                                                                         \
+    "   -C NUM, --context NUM\n"                                                                                 \
+    "       Print NUM lines of leading and trailing context. Groups of context are separated by --.\n"           \
+    "\n"                                                                                                         \
+    "   -E, --extended-regexp\n"                                                                                 \
+    "       Interpret STR as a POSIX extended regular expression.\n"                                             \
+    "\n"                                                                                                         \
+    "   -e STR, --regexp STR\n"                                                                                  \
+    "       Search for STR; may be repeated, and a newline in STR separates patterns. STR is not given.\n"       \
+    "\n"                                                                                                         \
+    "   -f FILE, --file FILE\n"                                                                                  \
+    "       Search for every line of FILE as a pattern (- for stdin). STR is then not given.\n"                  \
+    "\n"                                                                                                         \
+    "   -j NUM, --jobs NUM\n"                                                                                    \
+    "       Search with NUM threads, splitting a single FILE into chunks or spreading several FILEs.\n"          \
+    "\n"                                                                                                         \
+    "   -m NUM, --max-count NUM\n"                                                                               \
+    "       Stop reading a FILE after NUM selected lines. A negative NUM means no limit.\n"                      \
+    "\n"                                                                                                         \
+    "   --learn-freq\n"                                                                                          \
+    "       Pick the rare pattern bytes to skip ahead on from the first 64 KiB of FILE.\n"                       \
+    "\n"                                                                                                         \
+    "   --io-uring\n"                                                                                            \
+    "       Read files searched one after another through io_uring, with up to 32 reads in flight.\n"            \
+    "\n"                                                                                                         \
+    "   --index INDEX\n"                                                                                         \
+    "       Search the files indexed by \"sgrep index build DIR INDEX\" as -r over DIR. FILE is not given.\n"    \
+    "\n"                                                                                                         \
+    "   --kernel\n"                                                                                              \
+    "       Print the substring search kernel selected for this CPU and exit.\n"                                 \
+    "\n"                                                                                                         \
+    "   --serve SOCKET\n"                                                                                        \
+    "       Answer --client queries on the Unix socket SOCKET, caching patterns and mapped files.\n"             \
+    "\n"                                                                                                         \
+    "   --client SOCKET\n"                                                                                       \
+    "       Run the query given by the remaining arguments on the server at SOCKET.\n"                           \
     "\n"
 
+// long options without a short equivalent
+enum
+{
+    OPT_KERNEL = 256,
+    OPT_LEARN_FREQ,
+    OPT_IO_URING,
+    OPT_INDEX,
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////
 
-// linked list structs
-struct line_node
+// --help; returns the exit status
+static int usage(int status)
 {
-    struct list_head list;
-    char *line;
-    int line_num;
-};
+    puts(USAGE);
+    return status;
+}
 
-struct queue
+// patterns collected from STR, -e and -f
+struct pattern_list
 {
-    struct list_head head;
-    int size;
-    int max_capacity;
+    char **pats;
+    size_t n;
+    size_t cap;
 };
 
-static struct line_node *
-node_new(char *line, int line_num)
+static void
+pattern_list_add(struct pattern_list *pl, const char *s, size_t len)
 {
-    struct line_node *line_node;
-
-    line_node = malloc(sizeof(*line_node));
-    line_node->line = line;
-    line_node->line_num = line_num;
-
-    return line_node;
+    if (pl->n == pl->cap)
+    {
+        pl->cap = pl->cap ? pl->cap * 2 : 16;
+        pl->pats = mu_reallocarray(pl->pats, pl->cap, sizeof(*pl->pats));
+    }
+    pl->pats[pl->n] = mu_malloc(len + 1);
+    memcpy(pl->pats[pl->n], s, len);
+    pl->pats[pl->n][len] = '\0';
+    pl->n++;
 }
 
+// -e: a newline separates patterns, as in grep
 static void
-line_node_free(struct line_node *line_node)
+pattern_list_split(struct pattern_list *pl, const char *s)
 {
-    free(line_node->line);
-    free(line_node);
+    const char *nl;
+
+    while ((nl = strchr(s, '\n')) != NULL)
+    {
+        pattern_list_add(pl, s, nl - s);
+        s = nl + 1;
+    }
+    pattern_list_add(pl, s, strlen(s));
 }
 
-static void
-list_init(struct queue *queue)
+// -f: one pattern per line, "-" reads them from stdin; false if path
+// cannot be opened
+static bool
+pattern_list_read(struct pattern_list *pl, const char *path)
 {
-    INIT_LIST_HEAD(&queue->head);
-    queue->size = 0;
+    FILE *fh = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char *line = NULL;
+    size_t n = 0;
+    ssize_t nread;
+
+    if (fh == NULL)
+    {
+        mu_stderr_errno(errno, "sgrep: %s", path);
+        return false;
+    }
+
+    while ((nread = getline(&line, &n, fh)) != -1)
+    {
+        if (nread > 0 && line[nread - 1] == '\n')
+        {
+            nread--;
+        }
+        pattern_list_add(pl, line, nread);
+    }
+
+    free(line);
+    if (fh != stdin)
+    {
+        fclose(fh);
+    }
+    return true;
 }
 
 static void
-queue_print(const struct queue *queue)
+pattern_list_free(struct pattern_list *pl)
 {
-    struct line_node *line_node;
+    size_t i;
 
-    list_for_each_entry(line_node, &queue->head, list)
+    for (i = 0; i < pl->n; i++)
     {
-        printf("%s", line_node->line);
+        free(pl->pats[i]);
     }
+    free(pl->pats);
 }
 
-static void
-num_queue_print(const struct queue *queue)
+// --io-uring: a file whose read was started, waiting to be searched
+struct uring_file
 {
-    struct line_node *line_node;
+    char *path;
+    int fd;
+    size_t len;
+};
 
-    list_for_each_entry(line_node, &queue->head, list)
+// state shared by every file searched in one run
+struct run
+{
+    const struct matcher *mt;
+    const struct options *opts;
+    bool prefix;              // print the file name in front of each line
+    struct pool *pool;        // NULL when files are searched one after another
+    atomic_int status;        // 0 once any file gave a 0 exit status
+    atomic_bool stop;         // -q found a match, skip whatever is left
+    atomic_bool grouped;      // a context group was printed, the next needs "--"
+    struct out out;           // standard output
+    pthread_mutex_t out_lock; // held by pool workers writing to out
+    bool tty;                 // flush out after every file
+    struct serve_cache *cache; // --serve keeps files mapped here, or NULL
+    struct uring *uring;      // --io-uring, NULL when files are read as searched
+    struct uring_file queued[URING_DEPTH]; // read ahead, the oldest in slot qhead
+    unsigned qhead;
+    unsigned nqueued;
+    const struct index *ix; // --index: the index the files walked are looked up in, or NULL
+    const uint8_t *cand;    // --index: the blocks that may hold a match
+    bool narrow;            // --index: cand narrows the search
+};
+
+// a path waiting in the pool to be walked or searched
+struct path_task
+{
+    struct run *run;
+    char *path;
+};
+
+// the FILE naming standard input, and how its lines are prefixed
+#define STDIN_PATH "-"
+#define STDIN_NAME "(standard input)"
+
+// close a FILE's descriptor, leaving standard input open
+static void
+close_input(int fd, const char *path)
+{
+    if (strcmp(path, STDIN_PATH) != 0)
     {
-        printf("%d:%s", line_node->line_num, line_node->line);
+        close(fd);
     }
 }
 
-static void
-queue_insert(struct queue *queue, struct line_node *line_node)
+// -z: does the regular file fd start like a compressed stream
+static bool
+compressed(const struct options *opts, int fd)
 {
-    list_add_tail(&line_node->list, &queue->head);
-    queue->size += 1;
+    unsigned char magic[4];
+    size_t n;
+
+    return opts->decompress && mu_pread_n(fd, magic, sizeof(magic), 0, &n) == 0 && reader_compressed(magic, n);
 }
 
-static struct line_node *
-queue_remove(struct queue *queue)
+// Read lines function
+static int
+read_lines(const struct matcher *mt, const char *path, const struct options *opts, const struct sink *sink)
 {
-    struct line_node *line_node;
+    int status;
+    int fd = strcmp(path, STDIN_PATH) == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        mu_stderr_errno(errno, "sgrep: %s", path);
+        return 1;
+    }
 
-    line_node = list_first_entry_or_null(&queue->head, struct line_node, list);
-    if (line_node == NULL)
-        mu_die("queue_remove: empty queue");
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        mu_stderr_errno(errno, "sgrep: %s", path);
+        close_input(fd, path);
+        return 1;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        mu_stderr_errno(EISDIR, "sgrep: %s", path);
+        close_input(fd, path);
+        return 1;
+    }
 
-    list_del(&line_node->list);
-    queue->size -= 1;
+    // Regular files are mapped whole and scanned in place. Pipes, devices,
+    // files that report a zero size (e.g. procfs), standard input that was
+    // partly read already and with -z compressed files go through the
+    // read-ahead reader instead.
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0 && !compressed(opts, fd))
+    {
+        size_t len = (size_t)st.st_size;
+        char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            close_input(fd, path);
+            madvise(data, len, MADV_SEQUENTIAL);
+            status = scan_mapped(mt, opts, sink, data, len);
+            munmap(data, len);
+            return status;
+        }
+    }
 
-    return line_node;
+    status = scan_stream(mt, opts, sink, fd, strcmp(path, STDIN_PATH) == 0 ? STDIN_NAME : path);
+    close_input(fd, path);
+    return status;
 }
 
+// search one file and record its exit status; data holds the file's len
+// bytes when they were read already, or is NULL, and with ranges set only
+// those parts of data are searched
 static void
-queue_deinit(struct queue *queue)
+search_file(struct run *run, const char *path, const char *data, size_t len, const struct scan_range *ranges,
+            size_t nranges)
 {
-    struct line_node *line_node, *tmp;
+    const char *name = strcmp(path, STDIN_PATH) == 0 ? STDIN_NAME : path;
+    struct sink sink = {&run->out, run->prefix ? name : NULL, &run->grouped};
+    struct out file_out;
+    int status;
 
-    list_for_each_entry_safe(line_node, tmp, &queue->head, list)
+    if (atomic_load(&run->stop))
     {
-        list_del(&line_node->list);
-        line_node_free(line_node);
+        return;
     }
 
-    queue->size = 0;
-}
+    // With several workers each file's output is collected and written in
+    // one piece, so lines of different files never interleave. Whether it
+    // needs a "--" in front is only known when it is written.
+    if (run->pool != NULL)
+    {
+        out_init_mem(&file_out);
+        sink.out = &file_out;
+        sink.grouped = NULL;
+    }
 
-////////////////////////////////////////////////////////////////////////////////////////////
+    // --serve: a regular file is searched in the mapping kept from earlier
+    // queries, unless -z is to inflate it. Outside -v and the context modes
+    // only the lines an earlier query with the same patterns found matching
+    // are searched again; they are collected on the first query that reads
+    // the whole file anyway.
+    const struct serve_map *map = NULL;
+    bool narrowed = ranges != NULL;
+    if (data == NULL && run->cache != NULL && strcmp(path, STDIN_PATH) != 0)
+    {
+        map = serve_map(run->cache, path);
+        if (map != NULL && !(run->opts->decompress && reader_compressed((const unsigned char *)map->data, map->len)))
+        {
+            data = map->data;
+            len = map->len;
+        }
+    }
+    if (data != NULL && map != NULL && !run->opts->invert && !run->opts->context)
+    {
+        bool collect = !run->opts->quiet && run->opts->max_count == LONG_MAX;
+        narrowed = serve_matches(run->cache, map, run->mt, collect, &ranges, &nranges);
+    }
 
-// --help
-static void usage(int status)
-{
-    puts(USAGE);
-    exit(status);
+    if (narrowed)
+    {
+        status = scan_ranges(run->mt, run->opts, &sink, data, len, ranges, nranges);
+    }
+    else if (data != NULL)
+    {
+        status = scan_mapped(run->mt, run->opts, &sink, data, len);
+    }
+    else
+    {
+        status = read_lines(run->mt, path, run->opts, &sink);
+    }
+
+    if (run->pool != NULL)
+    {
+        pthread_mutex_lock(&run->out_lock);
+        if (file_out.len > 0 && run->opts->context && atomic_exchange(&run->grouped, true))
+        {
+            out_write(&run->out, "--\n", 3);
+        }
+        out_write(&run->out, file_out.buf, file_out.len);
+        if (run->tty)
+        {
+            out_flush(&run->out);
+        }
+        pthread_mutex_unlock(&run->out_lock);
+        out_deinit(&file_out);
+    }
+    else if (run->tty)
+    {
+        out_flush(&run->out);
+    }
+
+    if (status == 0)
+    {
+        atomic_store(&run->status, 0);
+        if (run->opts->quiet)
+        {
+            atomic_store(&run->stop, true);
+        }
+    }
+
+    // --serve: the client stopped reading, the rest would go nowhere
+    if (run->out.err != 0)
+    {
+        atomic_store(&run->stop, true);
+    }
 }
 
-// Read lines function
-void read_lines(const char *str, const char *path, int count, int linenumber, int quiet, int beforecontext, int context_num)
+// --io-uring: search the oldest file read ahead
+static void
+uring_next(struct run *run)
 {
-    FILE *fh = fopen(path, "r");
-    if (fh == NULL)
+    struct uring_file *f = &run->queued[run->qhead];
+    char *buf = uring_buf(run->uring, run->qhead);
+    ssize_t n = uring_wait(run->uring, run->qhead);
+
+    // a short read is finished off the usual way
+    if (n >= 0 && (size_t)n < f->len)
     {
-        perror("Error opening file");
-        exit(1);
+        size_t rest;
+        int err = mu_pread_n(f->fd, buf + n, f->len - n, n, &rest);
+        n = err < 0 ? err : n + (ssize_t)rest;
     }
 
-    char *line = NULL;
-    size_t n = 0;
-    int match_count = 0;
-    int line_num = 1;
+    if (n < 0)
+    {
+        mu_stderr_errno(-n, "sgrep: %s", f->path);
+    }
+    else if (run->opts->decompress && reader_compressed((unsigned char *)buf, n))
+    {
+        search_file(run, f->path, NULL, 0, NULL, 0);
+    }
+    else
+    {
+        search_file(run, f->path, buf, n, NULL, 0);
+    }
+
+    close(f->fd);
+    free(f->path);
+    run->qhead = (run->qhead + 1) % URING_DEPTH;
+    run->nqueued--;
+}
+
+// --io-uring: search every file read ahead
+static void
+uring_drain(struct run *run)
+{
+    while (run->nqueued > 0)
+    {
+        uring_next(run);
+    }
+}
 
-    struct queue context_queue;
-    list_init(&context_queue);
-    context_queue.max_capacity = context_num + 1;
+// --io-uring: start reading a file that fits a ring buffer and search it
+// once the files before it are done, keeping up to URING_DEPTH reads in
+// flight. Anything else, including a file whose read the ring refused, is
+// searched as usual, after the files queued before it. Takes path.
+static void
+uring_search(struct run *run, char *path)
+{
+    struct stat st;
+    int fd = strcmp(path, STDIN_PATH) == 0 ? -1 : open(path, O_RDONLY);
 
-    // quiet
-    if (quiet)
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= URING_BUF_SIZE)
     {
-        while (getline(&line, &n, fh) != -1)
+        unsigned slot;
+
+        if (run->nqueued == URING_DEPTH)
         {
-            if (strstr(line, str) != NULL)
-            {
-                free(line);
-                fclose(fh);
-                exit(0);
-            }
+            uring_next(run);
+        }
+        slot = (run->qhead + run->nqueued) % URING_DEPTH;
+        if (uring_read(run->uring, slot, fd, (size_t)st.st_size) == 0)
+        {
+            run->queued[slot].path = path;
+            run->queued[slot].fd = fd;
+            run->queued[slot].len = (size_t)st.st_size;
+            run->nqueued++;
+            return;
         }
-        free(line);
-        fclose(fh);
-        exit(1);
     }
 
-    // count
-    if (count)
+    if (fd != -1)
     {
-        while (getline(&line, &n, fh) != -1)
-        { // Check if the line contains the specified string
-            if (strstr(line, str) != NULL)
-            {
-                match_count++;
-            }
+        close(fd);
+    }
+    uring_drain(run);
+    search_file(run, path, NULL, 0, NULL, 0);
+    free(path);
+}
+
+static void walk_dir(struct run *run, const char *dir);
+static void index_file(struct run *run, const char *path);
+
+static void
+search_task(struct pool *pool, void *arg)
+{
+    struct path_task *task = arg;
+
+    MU_UNUSED(pool);
+    search_file(task->run, task->path, NULL, 0, NULL, 0);
+    free(task->path);
+    free(task);
+}
+
+static void
+walk_task(struct pool *pool, void *arg)
+{
+    struct path_task *task = arg;
+
+    MU_UNUSED(pool);
+    walk_dir(task->run, task->path);
+    free(task->path);
+    free(task);
+}
+
+// search path now, or hand it to the pool when there is one; takes path
+static void
+dispatch(struct run *run, char *path, bool is_dir)
+{
+    if (run->pool == NULL)
+    {
+        if (is_dir)
+        {
+            walk_dir(run, path);
         }
-        printf("%d\n", match_count);
-        free(line);
-        fclose(fh);
-        if (match_count != 0)
+        else if (run->uring != NULL)
+        {
+            uring_search(run, path);
+            return;
+        }
+        else if (run->ix != NULL)
         {
-            exit(0);
+            index_file(run, path);
         }
         else
         {
-            exit(1);
+            search_file(run, path, NULL, 0, NULL, 0);
         }
+        free(path);
+        return;
     }
 
-    // before context
-    if (beforecontext)
+    struct path_task *task = mu_malloc(sizeof(*task));
+    task->run = run;
+    task->path = path;
+    pool_submit(run->pool, is_dir ? walk_task : search_task, task);
+}
+
+// -r: search every regular file below dir; symbolic links are not followed
+static void
+walk_dir(struct run *run, const char *dir)
+{
+    DIR *dh;
+    struct dirent *ent;
+    size_t dir_len = strlen(dir);
+
+    if (atomic_load(&run->stop))
+    {
+        return;
+    }
+
+    dh = opendir(dir);
+    if (dh == NULL)
     {
-        while (getline(&line, &n, fh) != -1)
+        mu_stderr_errno(errno, "sgrep: %s", dir);
+        return;
+    }
+
+    while ((ent = readdir(dh)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
         {
-            struct line_node *new_node = node_new(strdup(line), line_num); // Create a new node with the current line
+            continue;
+        }
 
-            queue_insert(&context_queue, new_node);
+        size_t size = dir_len + strlen(ent->d_name) + 2;
+        char *path = mu_malloc(size);
+        bool slash = dir_len > 0 && dir[dir_len - 1] == '/';
+        mu_snprintf(path, size, "%s%s%s", dir, slash ? "" : "/", ent->d_name);
 
-            if (context_queue.size > context_queue.max_capacity)
-            {
-                struct line_node *oldest_node = queue_remove(&context_queue);
-                line_node_free(oldest_node);
-            }
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            type = lstat(path, &st) == -1 ? DT_UNKNOWN : S_ISDIR(st.st_mode) ? DT_DIR
+                                                       : S_ISREG(st.st_mode) ? DT_REG
+                                                                             : DT_UNKNOWN;
+        }
 
-            if (strstr(line, str) != NULL)
-            {
-                if (linenumber)
-                {
-                    num_queue_print(&context_queue);
-                }
-                else
-                {
-                    queue_print(&context_queue);
-                }
-            }
+        if (type == DT_DIR || type == DT_REG)
+        {
+            dispatch(run, path, type == DT_DIR);
+        }
+        else
+        {
+            free(path);
+        }
+    }
+
+    closedir(dh);
+}
 
-            line_num++;
+// --learn-freq: sample the start of the first regular file named
+static void
+learn_from(struct matcher *mt, char **paths, int npaths)
+{
+    static char sample[PATTERN_SAMPLE_SIZE];
+    struct stat st;
+    size_t n;
+    int i;
+
+    if (mt->kind != MATCHER_LITERAL)
+    {
+        return;
+    }
+
+    for (i = 0; i < npaths; i++)
+    {
+        int fd = open(paths[i], O_RDONLY);
+        if (fd == -1)
+        {
+            continue;
         }
-        free(line);
-        fclose(fh);
-        queue_deinit(&context_queue);
-        exit(1);
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && mu_pread_n(fd, sample, sizeof(sample), 0, &n) == 0)
+        {
+            pattern_learn(&mt->lit, sample, n);
+            close(fd);
+            return;
+        }
+        close(fd);
     }
+}
 
-    // standard output
-    while (getline(&line, &n, fh) != -1)
+// --index: search the blocks of the file f at path that cand marks, a run
+// of adjacent ones at a time
+static void
+index_ranges(struct run *run, const struct index *ix, const struct index_file *f, const char *path,
+             const uint8_t *cand)
+{
+    struct scan_range *ranges = mu_mallocarray(f->nblocks, sizeof(*ranges));
+    size_t nranges = 0;
+    uint32_t b, end;
+    char *data;
+    int fd;
+
+    for (b = f->block, end = f->block + f->nblocks; b < end; b++)
     {
-        if (strstr(line, str) != NULL)
+        if (!cand[b])
         {
-            if (linenumber)
-            {
-                printf("%d:", line_num);
-            }
-            printf("%s", line);
+            continue;
+        }
+        uint64_t next = b + 1 < end ? ix->blocks[b + 1].off : f->size;
+        if (nranges > 0 && ranges[nranges - 1].off + ranges[nranges - 1].len == ix->blocks[b].off)
+        {
+            ranges[nranges - 1].len = next - ranges[nranges - 1].off;
+            continue;
         }
-        line_num++;
+        ranges[nranges].off = ix->blocks[b].off;
+        ranges[nranges].len = next - ix->blocks[b].off;
+        ranges[nranges].line = (long)ix->blocks[b].line;
+        nranges++;
     }
-    free(line);
-    fclose(fh);
-    exit(0);
+
+    fd = open(path, O_RDONLY);
+    data = fd == -1 ? MAP_FAILED : mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        mu_stderr_errno(errno, "sgrep: %s", path);
+    }
+    else
+    {
+        search_file(run, path, data, f->size, ranges, nranges);
+        munmap(data, f->size);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    free(ranges);
 }
 
-// main
-int main(int argc, char *argv[])
+// --index: search the file at path, narrowed to its candidate blocks when
+// the index has it as it is now. A file that is new or changed since is
+// searched in full, as is one -z inflates, whose blocks were cut from the
+// compressed bytes.
+static void
+index_file(struct run *run, const char *path)
+{
+    const struct index *ix = run->ix;
+    const struct index_file *f = index_find(ix, path);
+    struct stat st;
+    uint32_t b;
+
+    if (!run->narrow || f == NULL || stat(path, &st) == -1 || !index_fresh(f, &st) ||
+        (run->opts->decompress && (f->flags & INDEX_COMPRESSED)))
+    {
+        search_file(run, path, NULL, 0, NULL, 0);
+        return;
+    }
+
+    for (b = f->block; b < f->block + f->nblocks && !run->cand[b]; b++)
+    {
+    }
+    if (b == f->block + f->nblocks)
+    {
+        // no block can match, which -c still reports
+        search_file(run, path, "", 0, NULL, 0);
+    }
+    else if (run->opts->context)
+    {
+        search_file(run, path, NULL, 0, NULL, 0);
+    }
+    else
+    {
+        index_ranges(run, ix, f, path, run->cand);
+    }
+}
+
+// --index: walk the directory ix was built from as -r does, so files added
+// since are found and those removed are not looked for
+static void
+index_search(struct run *run, const struct index *ix)
+{
+    uint8_t *cand = mu_zalloc(ix->hdr->nblocks + 1);
+
+    run->narrow = !run->opts->invert && index_candidates(ix, run->mt, cand);
+    run->ix = ix;
+    run->cand = cand;
+    dispatch(run, index_path(ix, ix->names + ix->hdr->root), true);
+    free(cand);
+}
+
+// "sgrep index build DIR [INDEX]" and "sgrep index refresh [INDEX]"
+static int
+index_command(int argc, char *argv[])
+{
+    if (argc >= 3 && argc <= 4 && strcmp(argv[1], "build") == 0)
+    {
+        return index_build(argv[2], argc == 4 ? argv[3] : INDEX_DEFAULT);
+    }
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "refresh") == 0)
+    {
+        return index_refresh(argc == 3 ? argv[2] : INDEX_DEFAULT);
+    }
+    mu_die("usage: sgrep index build DIR [INDEX]\n       sgrep index refresh [INDEX]");
+    return 1;
+}
+
+// -A, -B, -C
+static bool
+context_arg(const char *arg, int *num)
+{
+    if (mu_str_to_int(arg, 10, num) != 0 || *num < 0)
+    {
+        mu_stderr("invalid context length argument: %s", arg);
+        return false;
+    }
+    return true;
+}
+
+// one search as given on the command line, or sent by a --client
+struct query
 {
+    struct options opts;
+    struct pattern_list patterns;
+    bool pattern_file;
+    const char *index_path;
+    char **paths;
+    int npaths;
+};
+
+// Parse the options and arguments of a query. Returns -1 when it is to be
+// run, or else its exit status: -h, --kernel and errors are dealt with here.
+static int
+query_parse(struct query *q, int argc, char *argv[])
+{
+    static char *dot[] = {"."};
+    static char *dash[] = {STDIN_PATH};
+    struct options *opts = &q->opts;
     int opt;
-    int count = 0;
-    int linenumber = 0;
-    int quiet = 0;
-    int beforecontext = 0;
-    int context_num = 0;
+
+    memset(q, 0, sizeof(*q));
+    opts->jobs = 1;
+    opts->max_count = LONG_MAX;
 
     /*
      * An option that takes a required argument is followed by a ':'.
      * The leading ':' suppresses getopt_long's normal error handling.
+     * optind 0 starts afresh for each query --serve parses.
      */
 
-    const char *short_opts = ":hcnqB:";
+    const char *short_opts = ":hcnqrvzA:B:C:Ee:f:j:m:";
     struct option long_opts[] = {
         {"help", no_argument, NULL, 'h'},
         {"count", no_argument, NULL, 'c'},
         {"line-number", no_argument, NULL, 'n'},
         {"quiet", no_argument, NULL, 'q'},
+        {"recursive", no_argument, NULL, 'r'},
+        {"invert-match", no_argument, NULL, 'v'},
+        {"decompress", no_argument, NULL, 'z'},
+        {"after-context", required_argument, NULL, 'A'},
         {"before-context", required_argument, NULL, 'B'},
+        {"context", required_argument, NULL, 'C'},
+        {"extended-regexp", no_argument, NULL, 'E'},
+        {"regexp", required_argument, NULL, 'e'},
+        {"file", required_argument, NULL, 'f'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"max-count", required_argument, NULL, 'm'},
+        {"kernel", no_argument, NULL, OPT_KERNEL},
+        {"learn-freq", no_argument, NULL, OPT_LEARN_FREQ},
+        {"io-uring", no_argument, NULL, OPT_IO_URING},
+        {"index", required_argument, NULL, OPT_INDEX},
         {NULL, 0, NULL, 0}};
 
+    optind = 0;
     while (1)
     {
         opt = getopt_long(argc, argv, short_opts, long_opts, NULL);
@@ -293,44 +833,348 @@ int main(int argc, char *argv[])
         {
         case 'h':
         {
-            usage(0);
-            break;
+            return usage(0);
         }
         case 'c':
         {
-            count = 1;
+            opts->count = 1;
             break;
         }
         case 'n':
         {
-            linenumber = 1;
+            opts->linenumber = 1;
             break;
         }
         case 'q':
         {
-            quiet = 1;
+            opts->quiet = 1;
+            break;
+        }
+        case 'A':
+        {
+            opts->context = 1;
+            if (!context_arg(optarg, &opts->after_num))
+            {
+                return 1;
+            }
             break;
         }
         case 'B':
         {
-            beforecontext = 1;
-
-            char *endptr;
-            errno = 0;
-            context_num = strtol(optarg, &endptr, 10);
+            opts->context = 1;
+            if (!context_arg(optarg, &opts->before_num))
+            {
+                return 1;
+            }
             break;
         }
-        case '?':
-            mu_die("unknown option '%c' (decimal: %d)", optopt, optopt);
+        case 'C':
+        {
+            opts->context = 1;
+            if (!context_arg(optarg, &opts->before_num))
+            {
+                return 1;
+            }
+            opts->after_num = opts->before_num;
             break;
-        case ':':
-            mu_die("missing option argument for option %c", optopt);
+        }
+        case 'e':
+        {
+            pattern_list_split(&q->patterns, optarg);
+            break;
+        }
+        case 'f':
+        {
+            if (!pattern_list_read(&q->patterns, optarg))
+            {
+                return 1;
+            }
+            q->pattern_file = true;
+            break;
+        }
+        case 'j':
+        {
+            if (mu_str_to_int(optarg, 10, &opts->jobs) != 0 || opts->jobs < 1)
+            {
+                mu_stderr("invalid number of jobs: %s", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'm':
+        {
+            if (mu_str_to_long(optarg, 10, &opts->max_count) != 0)
+            {
+                mu_stderr("invalid max count: %s", optarg);
+                return 1;
+            }
+            if (opts->max_count < 0)
+            {
+                opts->max_count = LONG_MAX;
+            }
+            break;
+        }
+        case 'r':
+        {
+            opts->recursive = 1;
+            break;
+        }
+        case 'v':
+        {
+            opts->invert = 1;
+            break;
+        }
+        case 'z':
+        {
+            opts->decompress = 1;
+            break;
+        }
+        case 'E':
+        {
+            opts->extended = 1;
             break;
+        }
+        case OPT_KERNEL:
+        {
+            search_init();
+            printf("%s\n", search_kernel()->name);
+            return 0;
+        }
+        case OPT_LEARN_FREQ:
+        {
+            opts->learnfreq = 1;
+            break;
+        }
+        case OPT_IO_URING:
+        {
+            opts->uring = 1;
+            break;
+        }
+        case OPT_INDEX:
+        {
+            q->index_path = optarg;
+            break;
+        }
+        case '?':
+            mu_stderr("unknown option '%c' (decimal: %d)", optopt, optopt);
+            return 1;
+        case ':':
+            mu_stderr("missing option argument for option %c", optopt);
+            return 1;
         default:
-            mu_die("unexpected getopt_long return value: %c\n", (char)opt);
+            mu_stderr("unexpected getopt_long return value: %c\n", (char)opt);
+            return 1;
+        }
+    }
+    if (optind >= argc && q->patterns.n == 0 && !q->pattern_file)
+    {
+        return usage(1);
+    }
+
+    // with -e or -f every argument is a FILE, otherwise the first is STR
+    if (q->patterns.n == 0 && !q->pattern_file)
+    {
+        pattern_list_add(&q->patterns, argv[optind], strlen(argv[optind]));
+        optind++;
+    }
+
+    q->paths = &argv[optind];
+    q->npaths = argc - optind;
+    if (q->index_path != NULL && q->npaths > 0)
+    {
+        mu_stderr("sgrep: --index searches the files of the index, no FILE may be given");
+        return 1;
+    }
+    if (q->npaths == 0)
+    {
+        q->paths = opts->recursive ? dot : dash;
+        q->npaths = 1;
+    }
+    return -1;
+}
+
+// Run a parsed query and return its exit status. With cache set, for
+// --serve, compiled patterns and mapped files are taken from it and left in
+// it for the queries to come.
+static int
+query_run(struct query *q, struct serve_cache *cache)
+{
+    const struct options *opts = &q->opts;
+    const struct matcher *mt;
+    struct matcher own;
+    int status;
+
+    // -m 0: no line may be selected, so there is nothing to read
+    if (opts->max_count == 0)
+    {
+        return 1;
+    }
+
+    // --learn-freq tunes the matcher to the files at hand, which a cached one
+    // must not be
+    search_init();
+    if (cache != NULL && !opts->learnfreq)
+    {
+        mt = serve_matcher(cache, q->patterns.pats, q->patterns.n, opts->extended);
+        if (mt == NULL)
+        {
+            return 1;
         }
     }
-    char *str = argv[optind];
-    char *path = argv[optind + 1];
-    read_lines(str, path, count, linenumber, quiet, beforecontext, context_num);
-}
\ No newline at end of file
+    else
+    {
+        if (!matcher_compile(&own, q->patterns.pats, q->patterns.n, opts->extended))
+        {
+            return 1;
+        }
+        if (opts->learnfreq)
+        {
+            learn_from(&own, q->paths, q->npaths);
+        }
+        mt = &own;
+    }
+
+    struct run run;
+    struct options file_opts = *opts;
+    struct pool pool;
+    memset(&run, 0, sizeof(run));
+    run.mt = mt;
+    run.opts = opts;
+    run.prefix = q->npaths > 1 || opts->recursive || q->index_path != NULL;
+    atomic_init(&run.status, 1);
+    atomic_init(&run.stop, false);
+    out_init_fd(&run.out, STDOUT_FILENO);
+    run.out.keep_errors = cache != NULL;
+    run.out.timeout = cache != NULL ? SERVE_SEND_TIMEOUT * 1000 : 0;
+    pthread_mutex_init(&run.out_lock, NULL);
+    run.tty = isatty(STDOUT_FILENO);
+
+    // -j splits a single file into chunks; with several files or -r it sets
+    // the number of pool workers and each file is searched on one of them
+    if (opts->jobs > 1 && run.prefix && q->index_path == NULL)
+    {
+        file_opts.jobs = 1;
+        run.opts = &file_opts;
+        pool_init(&pool, opts->jobs);
+        run.pool = &pool;
+    }
+
+    // --io-uring reads ahead for files searched one after another; a kernel
+    // without io_uring simply leaves them to be read as they are searched
+    struct uring uring;
+    if (opts->uring && run.pool == NULL && q->index_path == NULL && uring_init(&uring) == 0)
+    {
+        run.uring = &uring;
+    }
+
+    // mappings are only shared by files searched one after another
+    if (run.pool == NULL)
+    {
+        run.cache = cache;
+    }
+
+    if (q->index_path != NULL)
+    {
+        struct index ix;
+        if (index_open(&ix, q->index_path))
+        {
+            index_search(&run, &ix);
+            index_close(&ix);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < q->npaths && !atomic_load(&run.stop); i++)
+        {
+            struct stat st;
+            bool is_dir = stat(q->paths[i], &st) == 0 && S_ISDIR(st.st_mode);
+
+            if (is_dir && !opts->recursive)
+            {
+                mu_stderr_errno(EISDIR, "sgrep: %s", q->paths[i]);
+                continue;
+            }
+            dispatch(&run, mu_strdup(q->paths[i]), is_dir);
+        }
+    }
+
+    if (run.uring != NULL)
+    {
+        uring_drain(&run);
+        uring_deinit(run.uring);
+    }
+    if (run.pool != NULL)
+    {
+        pool_run(run.pool);
+        pool_deinit(run.pool);
+    }
+    out_deinit(&run.out);
+    pthread_mutex_destroy(&run.out_lock);
+    if (mt == &own)
+    {
+        matcher_free(&own);
+    }
+
+    // the output did not all get out, a client's reader going away included
+    status = atomic_load(&run.status);
+    if (run.out.err != 0)
+    {
+        mu_stderr_errno(-run.out.err, "write error");
+        status = 1;
+    }
+    return status;
+}
+
+// --serve: one query of a client
+static int
+serve_query(struct serve_cache *cache, int argc, char *argv[])
+{
+    struct query q;
+    int status = query_parse(&q, argc, argv);
+
+    if (status < 0)
+    {
+        status = query_run(&q, cache);
+    }
+    pattern_list_free(&q.patterns);
+    return status;
+}
+
+// main
+int main(int argc, char *argv[])
+{
+    struct query q;
+    int status;
+
+    if (argc > 1 && strcmp(argv[1], "index") == 0)
+    {
+        search_init();
+        return index_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0)
+    {
+        if (argc != 3)
+        {
+            mu_die("usage: sgrep --serve SOCKET");
+        }
+        search_init();
+        return serve_run(argv[2], serve_query);
+    }
+    if (argc > 1 && strcmp(argv[1], "--client") == 0)
+    {
+        if (argc < 3)
+        {
+            mu_die("usage: sgrep --client SOCKET [OPTION]... STR [FILE...]");
+        }
+        // the socket path stands in for the program name
+        return serve_client(argv[2], argc - 2, argv + 2);
+    }
+
+    status = query_parse(&q, argc, argv);
+    if (status < 0)
+    {
+        status = query_run(&q, NULL);
+    }
+    pattern_list_free(&q.patterns);
+    return status;
+}
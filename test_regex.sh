@@ -0,0 +1,74 @@
+#!/bin/bash
+#
+# make check: compare sgrep -E against grep -E on random expressions.
+#
+# REGEX_TESTS expressions (default 500) over the bytes a, b and c are built
+# from sets, alternations, groups and every kind of repetition, nested a
+# few levels deep, and run with -n over random short lines of the same
+# bytes. Any expression whose output or exit status differs from grep's is
+# printed, and the script then fails. REGEX_SEED picks another sequence.
+
+SGREP=${SGREP:-./sgrep}
+GREP=${GREP:-grep}
+REGEX_TESTS=${REGEX_TESTS:-500}
+RANDOM=${REGEX_SEED:-1}
+
+export LC_ALL=C
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+chars="abc "
+for ((i = 0; i < 3000; i++)); do
+    line=
+    for ((j = RANDOM % 16; j > 0; j--)); do
+        line+=${chars:RANDOM%4:1}
+    done
+    echo "$line"
+done > "$dir/input"
+
+atoms=(a b c . "[ab]" "[^a]" "[a-c]" "\\." "^" "\$")
+reps=("*" "+" "?" "{2}" "{1,3}" "{0,2}" "{2,}")
+
+# an expression of at most the given depth, in $expr
+gen()
+{
+    local depth=$1 n k out= part
+    for ((n = 1 + RANDOM % 3; n > 0; n--)); do
+        if [ "$depth" -gt 0 ] && [ $((RANDOM % 3)) = 0 ]; then
+            gen $((depth - 1))
+            part="($expr"
+            if [ $((RANDOM % 2)) = 0 ]; then
+                gen $((depth - 1))
+                part+="|$expr"
+            fi
+            part+=")"
+        else
+            part=${atoms[RANDOM % ${#atoms[@]}]}
+        fi
+        k=$((RANDOM % 3))
+        if [ "$k" = 0 ] && [ "$part" != "^" ] && [ "$part" != "\$" ]; then
+            part+=${reps[RANDOM % ${#reps[@]}]}
+        fi
+        out+=$part
+    done
+    expr=$out
+}
+
+fail=0
+for ((t = 0; t < REGEX_TESTS; t++)); do
+    gen 3
+    "$GREP" -n -E -e "$expr" "$dir/input" > "$dir/want" 2>/dev/null
+    want=$?
+    "$SGREP" -n -E -e "$expr" "$dir/input" > "$dir/got" 2>/dev/null
+    got=$?
+    if [ "$want" != "$got" ] || ! cmp -s "$dir/want" "$dir/got"; then
+        echo "differs from $GREP -E: '$expr' (status $got, expected $want)"
+        fail=1
+    fi
+done
+
+if [ $fail = 0 ]; then
+    echo "regex: $REGEX_TESTS expressions agree with $GREP -E"
+fi
+exit $fail
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+
+#include "mu.h"
+#include "uring.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int
+uring_init(struct uring *u)
+{
+    struct io_uring_params p;
+    struct iovec iovs[URING_DEPTH];
+    char *sq, *cq;
+    int err;
+    unsigned i;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = sys_io_uring_setup(URING_DEPTH, &p);
+    if (u->fd == -1)
+    {
+        return -errno;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                      IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                      IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    u->bufs = mmap(NULL, (size_t)URING_DEPTH * URING_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED || u->bufs == MAP_FAILED)
+    {
+        err = -errno;
+        uring_deinit(u);
+        return err;
+    }
+
+    sq = u->sq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    cq = u->cq_ring;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Registered buffers spare the kernel mapping them on every read, but
+    // count against RLIMIT_MEMLOCK; without them plain reads do the job.
+    for (i = 0; i < URING_DEPTH; i++)
+    {
+        iovs[i].iov_base = uring_buf(u, i);
+        iovs[i].iov_len = URING_BUF_SIZE;
+    }
+    u->fixed = sys_io_uring_register(u->fd, IORING_REGISTER_BUFFERS, iovs, URING_DEPTH) == 0;
+
+    return 0;
+}
+
+void
+uring_deinit(struct uring *u)
+{
+    if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+    {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED)
+    {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sqes != NULL && u->sqes != MAP_FAILED)
+    {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->bufs != NULL && u->bufs != MAP_FAILED)
+    {
+        munmap(u->bufs, (size_t)URING_DEPTH * URING_BUF_SIZE);
+    }
+    close(u->fd);
+}
+
+int
+uring_read(struct uring *u, unsigned slot, int fd, size_t len)
+{
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    int n;
+
+    if (u->err != 0)
+    {
+        return u->err;
+    }
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = u->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)uring_buf(u, slot);
+    sqe->len = (unsigned)MU_MIN(len, (size_t)URING_BUF_SIZE);
+    sqe->off = 0;
+    sqe->buf_index = slot;
+    sqe->user_data = slot;
+    u->sq_array[idx] = idx;
+    u->done[slot] = false;
+
+    // the kernel must see the entry before the tail that publishes it
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while ((n = sys_io_uring_enter(u->fd, 1, 0, 0)) == -1 && errno == EINTR)
+    {
+    }
+    if (n == -1)
+    {
+        // the kernel took nothing, so the entry is withdrawn
+        __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+        return -errno;
+    }
+    return 0;
+}
+
+ssize_t
+uring_wait(struct uring *u, unsigned slot)
+{
+    while (!u->done[slot])
+    {
+        unsigned head = *u->cq_head;
+
+        if (u->err != 0)
+        {
+            return u->err;
+        }
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            if (sys_io_uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+            {
+                u->err = -errno;
+            }
+            continue;
+        }
+
+        // completions arrive in any order, each is filed under its slot
+        const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        u->res[cqe->user_data] = cqe->res;
+        u->done[cqe->user_data] = true;
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    return u->res[slot];
+}
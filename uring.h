@@ -0,0 +1,67 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// reads kept in flight at once
+#define URING_DEPTH 32
+
+// size of each read buffer; larger files are not read through the ring
+#define URING_BUF_SIZE (512 * 1024)
+
+// An io_uring driven by the raw system calls. Each of its URING_DEPTH slots
+// owns a buffer, registered with the kernel when the memlock limit allows,
+// and holds at most one read at a time.
+struct uring
+{
+    int fd;
+    bool fixed; // the buffers are registered, reads use IORING_OP_READ_FIXED
+
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    char *bufs; // URING_DEPTH buffers of URING_BUF_SIZE bytes
+    int res[URING_DEPTH];
+    bool done[URING_DEPTH];
+    int err; // negative errno of a failed wait; reads still in flight are lost
+};
+
+// returns 0, or a negative errno when the kernel offers no io_uring
+int uring_init(struct uring *u);
+void uring_deinit(struct uring *u);
+
+static inline char *
+uring_buf(struct uring *u, unsigned slot)
+{
+    return u->bufs + (size_t)slot * URING_BUF_SIZE;
+}
+
+// Start reading the first len bytes of fd, at most URING_BUF_SIZE, into
+// the buffer of a slot not in use. Returns 0, or a negative errno when the
+// read could not be started, which leaves the slot free.
+int uring_read(struct uring *u, unsigned slot, int fd, size_t len);
+
+// Wait for the read of slot; returns the bytes read or a negative errno.
+// Once waiting fails, it fails for every read not yet done, and no more
+// reads are started.
+ssize_t uring_wait(struct uring *u, unsigned slot);
+
+#endif /* _URING_H_ */